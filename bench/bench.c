@@ -0,0 +1,255 @@
+#include "expr.h"
+#include "graph.h"
+#include "engine/arena.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//   Measures the formula pipeline on its own, without a window: lexing,
+// compiling, evaluating one x at a time, in batches and as native code, and
+// sampling graph chunks. The corpus is every func: line of the levels in the
+// given directory plus a few formulas that stress the engine.
+//   Every measurement is repeated BENCH_RUNS times and reported as the median
+// and the 99th percentile of those runs.
+
+#define BENCH_RUNS 101
+#define BENCH_LEX_REPS 2000
+#define BENCH_COMPILE_REPS 200
+#define BENCH_XS 4096
+// chunks sampled per run, centered on x = 0
+#define BENCH_CHUNKS 16
+#define BENCH_FORMULAS 128
+#define BENCH_FORMULA_MAX 1024
+
+struct corpus {
+	char *formulas[BENCH_FORMULAS];
+	size_t count;
+};
+
+struct runs {
+	double runs[BENCH_RUNS];
+};
+
+// keeps the compiler from dropping the work being measured
+static volatile float sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(struct runs *st, double p)
+{
+	qsort(st->runs, BENCH_RUNS, sizeof *st->runs, cmp_double);
+	return st->runs[(size_t)(p * (BENCH_RUNS - 1) + 0.5)];
+}
+
+static void corpus_add(struct corpus *c, const char *formula)
+{
+	if (c->count == BENCH_FORMULAS)
+		return;
+
+	c->formulas[c->count++] = strdup(formula);
+}
+
+static void corpus_load_level(struct corpus *c, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return;
+
+	char line[BENCH_FORMULA_MAX];
+	while (fgets(line, sizeof line, f) != NULL) {
+		if (strncmp(line, "func:", 5) != 0)
+			continue;
+
+		line[strcspn(line, "\r\n")] = 0;
+
+		// a level may give several formulas on one line
+		const char separator[] = { GRAPH_SEPARATOR, 0 };
+		for (char *formula = strtok(line + 5, separator);
+		     formula != NULL; formula = strtok(NULL, separator))
+			corpus_add(c, formula);
+	}
+
+	fclose(f);
+}
+
+static void corpus_load_levels(struct corpus *c, const char *dir)
+{
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		printf("cannot open level directory \"%s\".\n", dir);
+		return;
+	}
+
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		const size_t len = strlen(e->d_name);
+		if (len < 4 || strcmp(e->d_name + len - 4, ".lvl") != 0)
+			continue;
+
+		char path[BENCH_FORMULA_MAX];
+		snprintf(path, sizeof path, "%s/%s", dir, e->d_name);
+		corpus_load_level(c, path);
+	}
+
+	closedir(d);
+}
+
+static void corpus_add_stress(struct corpus *c)
+{
+	static const char *fixed[] = {
+		"sin(sin(sin(sin(sin(sin(sin(sin(x))))))))",
+		"sin(x)+tan(x)+sin(2*x)+tan(x/2)+sin(3*x)+tan(x/3)+sin(4*x)",
+		"x^8/40320-x^6/720+x^4/24-x^2/2+1",
+		"3*x^7-2*x^6+5*x^5-x^4+7*x^3-4*x^2+x-9",
+		"abs(sin(x)*tan(x/3))/(x*x+1)+abs(x-3)^1.5",
+		"sin(x*x)+sin(x*x)*2+sin(x*x)/3",
+	};
+
+	for (size_t i = 0; i < sizeof fixed / sizeof *fixed; ++i)
+		corpus_add(c, fixed[i]);
+
+	// deep nesting, right leaning so that the value stack grows with it
+	char deep[BENCH_FORMULA_MAX] = "";
+	for (int i = 0; i < 24; ++i)
+		strcat(deep, "x*(1+");
+	strcat(deep, "x");
+	for (int i = 0; i < 24; ++i)
+		strcat(deep, ")");
+	corpus_add(c, deep);
+
+	// a long sum of transcendental terms
+	char sum[BENCH_FORMULA_MAX] = "0";
+	for (int i = 1; i <= 24; ++i) {
+		char term[32];
+		snprintf(term, sizeof term, "+sin(x/%d)+tan(x/%d)", i, i + 24);
+		strcat(sum, term);
+	}
+	corpus_add(c, sum);
+}
+
+static void bench_formula(const char *formula, struct arena *arena)
+{
+	struct runs lex, compile, interp, native, batch, sampling;
+
+	static float xs[BENCH_XS], ys[BENCH_XS];
+	for (size_t i = 0; i < BENCH_XS; ++i)
+		xs[i] = ((float)i - BENCH_XS / 2) / GRAPH_SCALE;
+
+	const size_t tokens = expr_count_tokens(formula);
+
+	struct expr_prog prog;
+	arena_reset(arena);
+	if (expr_compile(&prog, formula, arena) < 0) {
+		printf("%-40.40s does not compile\n", formula);
+		return;
+	}
+
+	const size_t nodes = prog.nodes;
+
+	//   Polynomials skip the bytecode when evaluated, so the interpreter is
+	// measured on a copy that does not know it is one.
+	struct expr_prog bytecode = prog;
+	bytecode.degree = -1;
+
+	struct graph_samples points = { 0 };
+	size_t npoints = 0;
+
+	for (size_t r = 0; r < BENCH_RUNS; ++r) {
+		double t = now_ns();
+		for (size_t i = 0; i < BENCH_LEX_REPS; ++i)
+			sink = (float)expr_count_tokens(formula);
+		lex.runs[r] = (now_ns() - t) / BENCH_LEX_REPS / (double)tokens;
+
+		t = now_ns();
+		for (size_t i = 0; i < BENCH_COMPILE_REPS; ++i) {
+			struct expr_prog p;
+			arena_reset(arena);
+			expr_compile(&p, formula, arena);
+			expr_destroy(&p);
+		}
+		compile.runs[r] =
+			(now_ns() - t) / BENCH_COMPILE_REPS / (double)nodes;
+
+		t = now_ns();
+		for (size_t i = 0; i < BENCH_XS; ++i)
+			sink = expr_eval(&bytecode, xs[i]);
+		interp.runs[r] = (now_ns() - t) / BENCH_XS;
+
+		t = now_ns();
+		expr_eval_batch(&prog, xs, ys, BENCH_XS);
+		batch.runs[r] = (now_ns() - t) / BENCH_XS;
+		sink = ys[BENCH_XS / 2];
+
+		npoints = 0;
+		t = now_ns();
+		for (int c = -BENCH_CHUNKS / 2; c < BENCH_CHUNKS / 2; ++c) {
+			points.count = 0;
+			graph_sample(&prog, c, &points);
+			npoints += points.count;
+		}
+		sampling.runs[r] = (double)npoints / ((now_ns() - t) * 1e-9);
+	}
+
+	// the same copy again, so that polynomials run native code too
+	expr_jit(&bytecode);
+	for (size_t r = 0; r < BENCH_RUNS; ++r) {
+		const double t = now_ns();
+		for (size_t i = 0; i < BENCH_XS; ++i)
+			sink = expr_eval(&bytecode, xs[i]);
+		native.runs[r] = (now_ns() - t) / BENCH_XS;
+	}
+	expr_jit_release(&bytecode);
+
+	printf("%-40.40s %4zu %4zu", formula, tokens, nodes);
+
+	struct runs *cols[] = { &lex, &compile, &interp, &native, &batch };
+	for (size_t i = 0; i < sizeof cols / sizeof *cols; ++i)
+		printf(" %6.1f/%-6.1f", percentile(cols[i], 0.5),
+		       percentile(cols[i], 0.99));
+
+	//   More points per second is better, so the slow tail is at the 1st
+	// percentile here.
+	printf(" %6.2f/%-6.2f %6zu\n", percentile(&sampling, 0.5) * 1e-6,
+	       percentile(&sampling, 0.01) * 1e-6, npoints);
+
+	graph_samples_destroy(&points);
+	expr_destroy(&prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = argc > 1 ? argv[1] : "res/lvl";
+
+	struct corpus corpus = { 0 };
+	corpus_load_levels(&corpus, dir);
+	corpus_add_stress(&corpus);
+
+	struct arena arena = arena_create(16 * 1024);
+
+	printf("%d runs each, cells are p50/p99 (points: p50/p1)\n\n", BENCH_RUNS);
+	printf("%-40s %4s %4s %13s %13s %13s %13s %13s %13s %6s\n", "formula",
+	       "tok", "node", "ns/token", "ns/node", "ns/eval", "ns/eval jit",
+	       "ns/eval batch", "Mpoints/s", "points");
+
+	for (size_t i = 0; i < corpus.count; ++i) {
+		bench_formula(corpus.formulas[i], &arena);
+		free(corpus.formulas[i]);
+	}
+
+	arena_destroy(&arena);
+	return 0;
+}
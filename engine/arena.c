@@ -0,0 +1,87 @@
+#include "engine/arena.h"
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+static __attribute__((noreturn)) void __int_arena_panic(const char *msg)
+{
+	printf("arena panic: %s\n", msg);
+	exit(0);
+}
+
+static size_t align_up(size_t size)
+{
+	const size_t a = alignof(max_align_t);
+	return (size + a - 1) / a * a;
+}
+
+static struct arena_block *block_create(size_t size)
+{
+	struct arena_block *block = malloc(sizeof *block + size);
+	if (block == NULL)
+		__int_arena_panic("out of memory.");
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+struct arena arena_create(size_t block_size)
+{
+	struct arena arena = { 0 };
+	arena.block_size = block_size;
+	arena.first = arena.cur = block_create(block_size);
+	return arena;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	struct arena_block *block = arena->first;
+	while (block != NULL) {
+		struct arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	memset(arena, 0, sizeof *arena);
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size = align_up(size);
+
+	struct arena_block *cur = arena->cur;
+
+	// blocks left over from before the last reset are reused in order
+	while (cur->used + size > cur->size) {
+		if (cur->next == NULL) {
+			const size_t bs = arena->block_size;
+			cur->next = block_create(size > bs ? size : bs);
+		}
+
+		cur = cur->next;
+		cur->used = 0;
+	}
+
+	arena->cur = cur;
+
+	void *p = cur->data + cur->used;
+	cur->used += size;
+	return p;
+}
+
+void *arena_calloc(struct arena *arena, size_t nmemb, size_t size)
+{
+	void *p = arena_alloc(arena, nmemb * size);
+	memset(p, 0, nmemb * size);
+	return p;
+}
+
+void arena_reset(struct arena *arena)
+{
+	arena->cur = arena->first;
+	arena->cur->used = 0;
+}
@@ -0,0 +1,1566 @@
+#include "expr.h"
+#include "engine/arena.h"
+#include <malloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define EXPR_DEBUG 0
+
+enum toktype {
+	TT_DEFAULT,
+	TT_UNKNOWN,
+	TT_NUM,
+	TT_X,
+	TT_T,
+	TT_OP,
+	TT_PAREN,
+	TT_FUNC,
+};
+
+enum prec {
+	PR_DEFAULT,
+	PR_ADDSUB,
+	PR_MULDIV,
+	PR_EXP,
+	PR_PAREN,
+};
+
+//   Tokens are views into the formula string rather than copies of it, only
+// their decoded value is kept alongside the span.
+struct tok {
+	enum toktype type;
+	enum prec prec;
+	size_t off, len;
+	union {
+		float num;
+		char op;
+		int func; // the opcode of the function, -1 if it is not known
+	};
+};
+
+struct node {
+	_Bool negative;
+	struct node *left, *right;
+	struct tok tok;
+
+	int cse; // the compiler's shared subtree entry, or -1
+};
+
+struct lexer {
+	const char *s;
+	size_t i;
+};
+
+static const struct {
+	const char *name;
+	enum expr_op op;
+} functions[] = {
+	{ "sin", EOP_SIN },
+	{ "abs", EOP_ABS },
+	{ "tan", EOP_TAN },
+};
+
+// Returns -1 if the function is not known.
+static int func_from_span(const char *s, size_t len)
+{
+	const size_t n = sizeof functions / sizeof *functions;
+	for (size_t i = 0; i < n; ++i) {
+		if (strlen(functions[i].name) == len &&
+		    memcmp(s, functions[i].name, len) == 0)
+			return (int)functions[i].op;
+	}
+
+	return -1;
+}
+
+//   Reads a number straight out of the source. Digits after a second '.' are
+// dropped, the same way atof() stops at it.
+static float num_from_span(const char *s, size_t len)
+{
+	double mant = 0.0, scale = 1.0;
+	_Bool frac = 0;
+
+	for (size_t i = 0; i < len; ++i) {
+		if (s[i] == '.') {
+			if (frac)
+				break;
+
+			frac = 1;
+			continue;
+		}
+
+		mant = mant * 10.0 + (s[i] - '0');
+		if (frac)
+			scale *= 10.0;
+	}
+
+	return (float)(mant / scale);
+}
+
+static enum toktype tt_from_char(char c)
+{
+	return c >= '0' && c <= '9' || c == '.' ? TT_NUM :
+	       c == 'x'		    ? TT_X :
+	       c >= 'a' && c <= 'z' ? TT_FUNC :
+	       c == '+' || c == '-' || c == '*' || c == '/' || c == '^' ?
+				      TT_OP :
+	       c == '(' || c == ')' ? TT_PAREN :
+				      TT_UNKNOWN;
+}
+
+static size_t get_prec(struct tok tok)
+{
+	switch (tok.op) {
+	case '+':
+	case '-':
+		return PR_ADDSUB;
+	case '*':
+	case '/':
+		return PR_MULDIV;
+	case '^':
+		return PR_EXP;
+	default:
+		return PR_DEFAULT;
+	}
+}
+
+//   Returns the next token, or TT_DEFAULT once the string has run out. Numbers
+// and function names take every following character of the same kind, every
+// other token is a single character and anything unknown is skipped.
+static struct tok lex_next(struct lexer *lex)
+{
+	const char *s = lex->s;
+
+	while (s[lex->i] != 0 && tt_from_char(s[lex->i]) == TT_UNKNOWN)
+		lex->i++;
+
+	struct tok tok = { .type = TT_DEFAULT, .off = lex->i };
+	if (s[lex->i] == 0)
+		return tok;
+
+	tok.type = tt_from_char(s[lex->i++]);
+	if (tok.type == TT_NUM || tok.type == TT_FUNC) {
+		while (tt_from_char(s[lex->i]) == tok.type)
+			lex->i++;
+	}
+
+	tok.len = lex->i - tok.off;
+
+	switch (tok.type) {
+	case TT_NUM:
+		tok.num = num_from_span(s + tok.off, tok.len);
+		break;
+	case TT_OP:
+	case TT_PAREN:
+		tok.op = s[tok.off];
+		break;
+	case TT_FUNC:
+		// a name that is just t is the time and not a function
+		if (tok.len == 1 && s[tok.off] == 't')
+			tok.type = TT_T;
+		else
+			tok.func = func_from_span(s + tok.off, tok.len);
+		break;
+	default:
+		break;
+	}
+
+	return tok;
+}
+
+static _Bool is_var(enum toktype type)
+{
+	return type == TT_X || type == TT_T;
+}
+
+static _Bool is_name(enum toktype type)
+{
+	return type == TT_FUNC || type == TT_T;
+}
+
+
+//   The parser pulls tokens from the lexer as it goes and only ever looks one
+// token ahead and two behind, so no token list is built.
+struct parser {
+	struct lexer lex;
+	struct tok prev, cur, next;
+	struct arena *arena;
+	size_t nodes;
+};
+
+static struct node *newnode(struct parser *par, struct tok tok)
+{
+	struct node *node = arena_alloc(par->arena, sizeof(struct node));
+	node->tok = tok;
+	node->negative = 0;
+	node->left = NULL;
+	node->right = NULL;
+	node->cse = -1;
+	par->nodes++;
+	return node;
+}
+
+static struct tok parser_advance(struct parser *par)
+{
+	par->prev = par->cur;
+	par->cur = par->next;
+	par->next = lex_next(&par->lex);
+	return par->cur;
+}
+
+static struct tok parser_peek(struct parser *par)
+{
+	return par->next;
+}
+
+struct node *parse_expr(struct parser *par, enum prec min_prec);
+
+static struct node *parse_primary(struct parser *par)
+{
+	struct tok tok = parser_advance(par);
+	struct tok next = parser_peek(par);
+
+	if (tok.type == TT_FUNC && next.type == TT_PAREN && next.op == '(') {
+		struct node *f = newnode(par, tok);
+		parser_advance(par);
+		f->left = parse_expr(par, PR_DEFAULT);
+		parser_advance(par);
+		return f;
+	}
+
+	if (tok.type == TT_PAREN && tok.op == '(') {
+		struct node *node = parse_expr(par, PR_DEFAULT);
+		parser_advance(par);
+		return node;
+	}
+
+	// a minus at the start, after an operator or after '(' is a sign
+	const struct tok prev = par->prev;
+	const _Bool unary = tok.type == TT_OP && tok.op == '-' &&
+			    (prev.type == TT_OP ||
+			     (prev.type == TT_PAREN && prev.op == '('));
+
+	if (unary && next.type != TT_NUM && !is_var(next.type)) {
+		struct node *node = parse_primary(par);
+		node->negative = !node->negative;
+		return node;
+	}
+
+	const _Bool negative = unary;
+
+	if (negative) {
+		tok = parser_advance(par);
+		next = parser_peek(par);
+	}
+
+	if (is_var(next.type)) {
+		struct node *mul = newnode(par, (struct tok){ .type = TT_OP, .op = '*' });
+		mul->left = newnode(par, tok);
+		mul->left->negative = negative;
+		mul->right = newnode(par, parser_advance(par));
+		return mul;
+	}
+
+	struct node *node = newnode(par, tok);
+	node->negative = negative;
+	return node;
+}
+
+struct node *parse_expr(struct parser *par, enum prec min_prec)
+{
+	struct node *left = parse_primary(par);
+
+	struct tok tok_next;
+	for (; parser_peek(par).type != TT_DEFAULT;) {
+		tok_next = parser_peek(par);
+
+		if ((tok_next.type == TT_PAREN && tok_next.op == ')'))
+			break;
+
+		struct tok op_tok = tok_next;
+		enum prec op_prec = get_prec(op_tok);
+
+		if (op_prec < min_prec)
+			break;
+
+		parser_advance(par);
+
+		struct node *right = parse_expr(par, op_prec + 1);
+
+		struct node *bin = newnode(par, op_tok);
+		bin->left = left;
+		bin->right = right;
+		left = bin;
+	}
+
+	return left;
+}
+
+static struct node *parse(const char *s, struct arena *arena, size_t *nodes)
+{
+	// the token before the first one reads as an operator, so a leading
+	// minus is a sign
+	struct parser par = {
+		.lex = { .s = s, .i = 0 },
+		.cur = { .type = TT_OP },
+		.arena = arena,
+	};
+
+	par.next = lex_next(&par.lex);
+	struct node *root = parse_expr(&par, PR_DEFAULT);
+
+	*nodes = par.nodes;
+	return root;
+}
+
+static void view_tokens(const char *s)
+{
+	struct lexer lex = { .s = s, .i = 0 };
+
+	printf("token list: ");
+	for (struct tok tok = lex_next(&lex); tok.type != TT_DEFAULT;
+	     tok = lex_next(&lex)) {
+		printf("{ t: %d, s: \"%.*s\" } ", tok.type, (int)tok.len,
+		       s + tok.off);
+	}
+	printf("\n");
+}
+
+static void rview_nodes(struct node *node, size_t depth)
+{
+	printf("([%lu] %d, %f (%c), neg: %d)", depth, node->tok.type, node->tok.num,
+	       node->tok.op, node->negative);
+	if (node->left != NULL && node->right != NULL) {
+		printf("{ L: ");
+		rview_nodes(node->left, depth + 1);
+		printf(", R: ");
+		rview_nodes(node->right, depth + 1);
+		printf(" }");
+	}
+}
+
+static void view_nodes(struct node *root)
+{
+	rview_nodes(root, 0);
+	printf("\n");
+}
+
+static int op_from_char(char c)
+{
+	switch (c) {
+	case '+':
+		return EOP_ADD;
+	case '-':
+		return EOP_SUB;
+	case '*':
+		return EOP_MUL;
+	case '/':
+		return EOP_DIV;
+	case '^':
+		return EOP_POW;
+	default:
+		return -1;
+	}
+}
+
+static float apply_unary(enum expr_op op, float v)
+{
+	switch (op) {
+	case EOP_NEG:
+		return -v;
+	case EOP_SIN:
+		return sinf(v);
+	case EOP_ABS:
+		return fabsf(v);
+	case EOP_TAN:
+		return tanf(v);
+	default:
+		return 0;
+	}
+}
+
+static float apply_binary(enum expr_op op, float a, float b)
+{
+	switch (op) {
+	case EOP_ADD:
+		return a + b;
+	case EOP_SUB:
+		return a - b;
+	case EOP_MUL:
+		return a * b;
+	case EOP_DIV:
+		return a / b;
+	case EOP_POW:
+		return powf(a, b);
+	default:
+		return 0;
+	}
+}
+
+static _Bool is_num(const struct node *node, float v)
+{
+	return node->tok.type == TT_NUM && node->tok.num == v;
+}
+
+// Whether <node> is a zero whose sign bit is <negative>.
+static _Bool is_zero(const struct node *node, _Bool negative)
+{
+	return is_num(node, 0) && (signbit(node->tok.num) != 0) == negative;
+}
+
+//   Constants carry their sign in the value, so the <negative> flag only ever
+// survives on nodes that have to be negated at runtime.
+static struct node *canon_sign(struct node *node)
+{
+	if (node->tok.type == TT_NUM && node->negative) {
+		node->tok.num = -node->tok.num;
+		node->negative = 0;
+	}
+
+	return node;
+}
+
+static struct node *make_num(struct node *node, float v)
+{
+	node->tok = (struct tok){ .type = TT_NUM, .num = v };
+	node->left = node->right = NULL;
+	return canon_sign(node);
+}
+
+//   Replaces <node> with its child <keep>, carrying the sign over. The nodes
+// left behind belong to the arena and go away with it.
+static struct node *hoist(struct node *node, struct node *keep)
+{
+	keep->negative ^= node->negative;
+	return canon_sign(keep);
+}
+
+static struct node *optimize_op(struct node *node)
+{
+	const int op = op_from_char(node->tok.op);
+	struct node *l = node->left;
+	struct node *r = node->right;
+
+	// those lower to constants or -x and are left alone
+	if (op < 0 || l == NULL || r == NULL)
+		return node;
+
+	// pull signs out of products so that sums can absorb them
+	if (op == EOP_MUL || op == EOP_DIV) {
+		if (l->negative) {
+			l->negative = 0;
+			node->negative ^= 1;
+		}
+		if (r->negative) {
+			r->negative = 0;
+			node->negative ^= 1;
+		}
+		if (node->negative && (l->tok.type == TT_NUM ||
+				       r->tok.type == TT_NUM)) {
+			struct node *k = l->tok.type == TT_NUM ? l : r;
+			k->tok.num = -k->tok.num;
+			node->negative = 0;
+		}
+	}
+
+	if ((op == EOP_ADD || op == EOP_SUB) &&
+	    (r->negative || (r->tok.type == TT_NUM && signbit(r->tok.num) &&
+			     r->tok.num != 0))) {
+		// a + -b = a - b and a - -b = a + b
+		if (r->tok.type == TT_NUM)
+			r->tok.num = -r->tok.num;
+		r->negative = 0;
+		node->tok.op = op == EOP_ADD ? '-' : '+';
+		return optimize_op(node);
+	}
+
+	if (op == EOP_ADD && l->negative) {
+		// -a + b = b - a
+		l->negative = 0;
+		node->left = r;
+		node->right = l;
+		node->tok.op = '-';
+		return optimize_op(node);
+	}
+
+	if (l->tok.type == TT_NUM && r->tok.type == TT_NUM)
+		return make_num(node, apply_binary((enum expr_op)op, l->tok.num,
+						   r->tok.num));
+
+	//   Only adding -0 leaves every value as it is, +0 turns -0 into +0. So
+	// a + 0 and 0 - a stay, the latter being +0 rather than -0 at a = 0.
+	switch (op) {
+	case EOP_ADD:
+		if (is_zero(r, 1))
+			return hoist(node, l);
+		if (is_zero(l, 1))
+			return hoist(node, r);
+		break;
+	case EOP_SUB:
+		if (is_zero(r, 0))
+			return hoist(node, l);
+		if (is_zero(l, 1)) {
+			node->negative ^= 1;
+			return hoist(node, r);
+		}
+		break;
+	case EOP_MUL:
+		if (is_num(r, 1))
+			return hoist(node, l);
+		if (is_num(l, 1))
+			return hoist(node, r);
+		break;
+	case EOP_DIV:
+		if (is_num(r, 1))
+			return hoist(node, l);
+		break;
+	case EOP_POW:
+		if (is_num(r, 1))
+			return hoist(node, l);
+		if (is_num(r, 0))
+			return make_num(node, node->negative ? -1 : 1);
+		break;
+	default:
+		break;
+	}
+
+	return node;
+}
+
+static struct node *optimize_func(struct node *node)
+{
+	const int f = node->tok.func;
+	struct node *arg = node->left;
+
+	if (f < 0 || arg == NULL)
+		return node;
+
+	if (arg->tok.type == TT_NUM)
+		return make_num(node, (node->negative ? -1 : 1) *
+					      apply_unary((enum expr_op)f,
+							  arg->tok.num));
+
+	if (arg->negative) {
+		// abs is even, sin and tan are odd
+		arg->negative = 0;
+		if (f != EOP_ABS)
+			node->negative ^= 1;
+	}
+
+	return node;
+}
+
+//   Folds constant subtrees, drops identity operations and moves signs to
+// where they are cheapest. Every rewrite is exact in floating point, down to
+// the sign of zero, so the optimized formula samples to the same values as the
+// one that was typed in.
+static struct node *optimize(struct node *node)
+{
+	if (node == NULL)
+		return NULL;
+
+	node->left = optimize(node->left);
+	node->right = optimize(node->right);
+
+	switch (node->tok.type) {
+	case TT_NUM:
+		return canon_sign(node);
+	case TT_OP:
+		return optimize_op(node);
+	case TT_FUNC:
+		return optimize_func(node);
+	default:
+		return node;
+	}
+}
+
+struct poly {
+	int degree;
+	double coef[EXPR_POLY_MAX + 1];
+};
+
+static void poly_negate(struct poly *p)
+{
+	for (int i = 0; i <= p->degree; ++i)
+		p->coef[i] = -p->coef[i];
+}
+
+static int poly_mul(struct poly *into, const struct poly *a,
+		    const struct poly *b)
+{
+	if (a->degree + b->degree > EXPR_POLY_MAX)
+		return -1;
+
+	struct poly r = { .degree = a->degree + b->degree };
+	for (int i = 0; i <= a->degree; ++i) {
+		for (int j = 0; j <= b->degree; ++j)
+			r.coef[i + j] += a->coef[i] * b->coef[j];
+	}
+
+	*into = r;
+	return 0;
+}
+
+// Returns -1 if the subtree is not a polynomial of a small enough degree.
+static int to_poly(const struct node *node, struct poly *p)
+{
+	*p = (struct poly){ 0 };
+
+	if (node == NULL) {
+		p->degree = 1;
+		p->coef[1] = -1;
+		return 0;
+	}
+
+	struct poly l, r;
+
+	switch (node->tok.type) {
+	case TT_NUM:
+		p->coef[0] = node->tok.num;
+		break;
+	case TT_X:
+		p->degree = 1;
+		p->coef[1] = 1;
+		break;
+	case TT_T:
+		return -1;
+	case TT_OP: {
+		const int op = op_from_char(node->tok.op);
+		if (op < 0)
+			break;
+
+		if (to_poly(node->left, &l) < 0 || to_poly(node->right, &r) < 0)
+			return -1;
+
+		switch (op) {
+		case EOP_SUB:
+			poly_negate(&r);
+			// fallthrough
+		case EOP_ADD:
+			*p = l.degree > r.degree ? l : r;
+			for (int i = 0; i <= l.degree && i <= r.degree; ++i)
+				p->coef[i] = l.coef[i] + r.coef[i];
+			break;
+		case EOP_MUL:
+			if (poly_mul(p, &l, &r) < 0)
+				return -1;
+			break;
+		case EOP_DIV:
+			if (r.degree != 0 || r.coef[0] == 0)
+				return -1;
+			*p = l;
+			for (int i = 0; i <= p->degree; ++i)
+				p->coef[i] /= r.coef[0];
+			break;
+		case EOP_POW: {
+			const double e = r.coef[0];
+			// NaN gets past the range checks and cannot be cast
+			if (r.degree != 0 || !isfinite(e) || e < 0 ||
+			    e > EXPR_POLY_MAX || e != (int)e ||
+			    l.degree * (int)e > EXPR_POLY_MAX)
+				return -1;
+
+			p->coef[0] = 1;
+			for (int i = 0; i < (int)e; ++i)
+				poly_mul(p, p, &l);
+			break;
+		}
+		default:
+			return -1;
+		}
+		break;
+	}
+	case TT_FUNC:
+		if (node->tok.func >= 0)
+			return -1;
+		break;
+	default:
+		break;
+	}
+
+	if (node->negative)
+		poly_negate(p);
+
+	// a sum can cancel its leading terms out
+	while (p->degree > 0 && p->coef[p->degree] == 0)
+		p->degree--;
+
+	return 0;
+}
+
+struct cse_entry {
+	const struct node *node;
+	unsigned count;
+	int reg;
+	_Bool stored;
+};
+
+#define CSE_MAX 256
+
+static _Bool same_tree(const struct node *a, const struct node *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	if (a->negative != b->negative || a->tok.type != b->tok.type)
+		return 0;
+
+	switch (a->tok.type) {
+	case TT_NUM:
+		return memcmp(&a->tok.num, &b->tok.num, sizeof a->tok.num) == 0;
+	case TT_OP:
+		return a->tok.op == b->tok.op && same_tree(a->left, b->left) &&
+		       same_tree(a->right, b->right);
+	case TT_FUNC:
+		return a->tok.func == b->tok.func &&
+		       same_tree(a->left, b->left);
+	default:
+		return 1;
+	}
+}
+
+//   The compiler runs twice over the tree: once without <code> to size the
+// program and find its stack depth, then again to actually emit it.
+struct compiler {
+	struct expr_ins *code;
+	size_t len;
+	size_t depth, max_depth;
+
+	struct cse_entry *shared;
+	size_t nshared;
+	size_t nregs;
+};
+
+//   Walks the tree in pre-order and links every operation to the first
+// identical subtree. The first occurrence is also the first one emitted, so
+// it can leave its value in a register for the others to load. Repeats are
+// not descended into, since they will never be emitted.
+static void find_shared(struct compiler *c, struct node *node)
+{
+	if (node == NULL ||
+	    (node->tok.type != TT_OP && node->tok.type != TT_FUNC))
+		return;
+
+	for (size_t i = 0; i < c->nshared; ++i) {
+		if (same_tree(c->shared[i].node, node)) {
+			c->shared[i].count++;
+			node->cse = (int)i;
+			return;
+		}
+	}
+
+	if (c->nshared < CSE_MAX) {
+		node->cse = (int)c->nshared;
+		c->shared[c->nshared++] = (struct cse_entry){
+			.node = node,
+			.count = 1,
+			.reg = -1,
+		};
+	}
+
+	find_shared(c, node->left);
+	find_shared(c, node->right);
+}
+
+static void assign_regs(struct compiler *c)
+{
+	for (size_t i = 0; i < c->nshared && c->nregs < EXPR_REGS; ++i) {
+		if (c->shared[i].count > 1)
+			c->shared[i].reg = (int)c->nregs++;
+	}
+}
+
+static void emit_ins(struct compiler *c, struct expr_ins ins)
+{
+	if (c->code != NULL)
+		c->code[c->len] = ins;
+	c->len++;
+
+	switch (ins.op) {
+	case EOP_CONST:
+	case EOP_X:
+	case EOP_T:
+	case EOP_LOAD:
+		c->depth++;
+		break;
+	case EOP_ADD:
+	case EOP_SUB:
+	case EOP_MUL:
+	case EOP_DIV:
+	case EOP_POW:
+		c->depth--;
+		break;
+	default:
+		break;
+	}
+
+	if (c->depth > c->max_depth)
+		c->max_depth = c->depth;
+}
+
+static void emit(struct compiler *c, enum expr_op op, float imm)
+{
+	emit_ins(c, (struct expr_ins){ .op = op, .imm = imm });
+}
+
+static void emit_reg(struct compiler *c, enum expr_op op, int reg)
+{
+	emit_ins(c, (struct expr_ins){ .op = op, .reg = (unsigned)reg });
+}
+
+static void lower(struct compiler *c, struct node *node);
+
+static void lower_node(struct compiler *c, struct node *node)
+{
+	const struct tok tok = node->tok;
+
+	switch (tok.type) {
+	case TT_OP: {
+		const int op = op_from_char(tok.op);
+		if (op < 0) {
+			emit(c, EOP_CONST, 0);
+			return;
+		}
+
+		lower(c, node->left);
+		lower(c, node->right);
+		emit(c, (enum expr_op)op, 0);
+		return;
+	}
+	case TT_X:
+		emit(c, EOP_X, 0);
+		return;
+	case TT_T:
+		emit(c, EOP_T, 0);
+		return;
+	case TT_FUNC: {
+		const int f = tok.func;
+		if (f < 0) {
+			emit(c, EOP_CONST, 0);
+			return;
+		}
+
+		lower(c, node->left);
+		emit(c, (enum expr_op)f, 0);
+		return;
+	}
+	default:
+		emit(c, EOP_CONST, 0);
+		return;
+	}
+}
+
+static void lower(struct compiler *c, struct node *node)
+{
+	// a missing operand has always evaluated to -x
+	if (node == NULL) {
+		emit(c, EOP_X, 0);
+		emit(c, EOP_NEG, 0);
+		return;
+	}
+
+	if (node->tok.type == TT_NUM) {
+		emit(c, EOP_CONST,
+		     node->negative ? -node->tok.num : node->tok.num);
+		return;
+	}
+
+	struct cse_entry *sh = node->cse >= 0 ? &c->shared[node->cse] : NULL;
+	if (sh != NULL && sh->reg < 0)
+		sh = NULL;
+
+	if (sh != NULL && sh->stored) {
+		emit_reg(c, EOP_LOAD, sh->reg);
+		return;
+	}
+
+	lower_node(c, node);
+
+	if (node->negative)
+		emit(c, EOP_NEG, 0);
+
+	if (sh != NULL) {
+		emit_reg(c, EOP_STORE, sh->reg);
+		sh->stored = 1;
+	}
+}
+
+size_t expr_count_tokens(const char *s)
+{
+	struct lexer lex = { .s = s, .i = 0 };
+	size_t n = 0;
+
+	while (lex_next(&lex).type != TT_DEFAULT)
+		n++;
+
+	return n;
+}
+
+size_t expr_normalize(char *dst, const char *s)
+{
+	struct lexer lex = { .s = s, .i = 0 };
+	enum toktype prev = TT_DEFAULT;
+	size_t n = 0;
+
+	for (struct tok tok = lex_next(&lex); tok.type != TT_DEFAULT;
+	     tok = lex_next(&lex)) {
+		// two numbers or two names in a row were apart in the source
+		// and must stay apart
+		if ((tok.type == TT_NUM && prev == TT_NUM) ||
+		    (is_name(tok.type) && is_name(prev)))
+			dst[n++] = ' ';
+
+		memcpy(dst + n, s + tok.off, tok.len);
+		n += tok.len;
+		prev = tok.type;
+	}
+
+	dst[n] = 0;
+	return n;
+}
+
+int expr_compile(struct expr_prog *prog, const char *s, struct arena *arena)
+{
+	if (EXPR_DEBUG)
+		view_tokens(s);
+
+	size_t nodes;
+	struct node *ast = optimize(parse(s, arena, &nodes));
+	if (EXPR_DEBUG)
+		view_nodes(ast);
+
+	struct cse_entry shared[CSE_MAX];
+	struct compiler c = { .shared = shared };
+	find_shared(&c, ast);
+	assign_regs(&c);
+
+	lower(&c, ast);
+
+	if (c.max_depth > EXPR_STACK_MAX)
+		return -1;
+
+	*prog = (struct expr_prog){
+		.code = malloc(c.len * sizeof *prog->code),
+		.len = c.len,
+		.depth = c.max_depth,
+		.nregs = c.nregs,
+		.nodes = nodes,
+		.degree = -1,
+	};
+
+	struct poly poly;
+	if (to_poly(ast, &poly) == 0) {
+		prog->degree = poly.degree;
+		memcpy(prog->coef, poly.coef, sizeof poly.coef);
+	}
+
+	for (size_t i = 0; i < c.nshared; ++i)
+		shared[i].stored = 0;
+
+	c.code = prog->code;
+	c.len = c.depth = 0;
+	lower(&c, ast);
+
+	for (size_t i = 0; i < prog->len; ++i)
+		prog->timed |= prog->code[i].op == EOP_T;
+
+	return 0;
+}
+
+void expr_destroy(struct expr_prog *prog)
+{
+	expr_jit_release(prog);
+	free(prog->code);
+	memset(prog, 0, sizeof *prog);
+	prog->degree = -1;
+}
+
+static float eval_poly(const struct expr_prog *prog, float x)
+{
+	double y = prog->coef[prog->degree];
+	for (int i = prog->degree - 1; i >= 0; --i)
+		y = y * x + prog->coef[i];
+
+	return (float)y;
+}
+
+float expr_eval(const struct expr_prog *prog, float x)
+{
+	if (prog->degree >= 0)
+		return eval_poly(prog, x);
+
+	if (prog->native != NULL)
+		return prog->native(x, prog->t);
+
+	float stack[EXPR_STACK_MAX];
+	float regs[EXPR_REGS];
+	float *sp = stack;
+
+	const struct expr_ins *ins = prog->code;
+	const struct expr_ins *end = ins + prog->len;
+
+	for (; ins < end; ++ins) {
+		switch (ins->op) {
+		case EOP_CONST:
+			*sp++ = ins->imm;
+			break;
+		case EOP_X:
+			*sp++ = x;
+			break;
+		case EOP_T:
+			*sp++ = prog->t;
+			break;
+		case EOP_NEG:
+			sp[-1] = -sp[-1];
+			break;
+		case EOP_ADD:
+			--sp;
+			sp[-1] += sp[0];
+			break;
+		case EOP_SUB:
+			--sp;
+			sp[-1] -= sp[0];
+			break;
+		case EOP_MUL:
+			--sp;
+			sp[-1] *= sp[0];
+			break;
+		case EOP_DIV:
+			--sp;
+			sp[-1] /= sp[0];
+			break;
+		case EOP_POW:
+			--sp;
+			sp[-1] = powf(sp[-1], sp[0]);
+			break;
+		case EOP_SIN:
+			sp[-1] = sinf(sp[-1]);
+			break;
+		case EOP_ABS:
+			sp[-1] = fabsf(sp[-1]);
+			break;
+		case EOP_TAN:
+			sp[-1] = tanf(sp[-1]);
+			break;
+		case EOP_STORE:
+			regs[ins->reg] = sp[-1];
+			break;
+		case EOP_LOAD:
+			*sp++ = regs[ins->reg];
+			break;
+		}
+	}
+
+	return stack[0];
+}
+
+//   Forward mode differentiation: every stack entry carries its derivative
+// with respect to x along with its value. The values go through the same
+// float operations as expr_eval(), so both agree exactly.
+struct dual {
+	float v, d;
+};
+
+float expr_eval_dual(const struct expr_prog *prog, float x, float *dy)
+{
+	if (prog->degree >= 0) {
+		double d = 0.0;
+		for (int i = prog->degree; i >= 1; --i)
+			d = d * x + i * prog->coef[i];
+
+		*dy = (float)d;
+		return eval_poly(prog, x);
+	}
+
+	struct dual stack[EXPR_STACK_MAX];
+	struct dual regs[EXPR_REGS];
+	struct dual *sp = stack;
+
+	const struct expr_ins *ins = prog->code;
+	const struct expr_ins *end = ins + prog->len;
+
+	for (; ins < end; ++ins) {
+		struct dual a, b;
+
+		switch (ins->op) {
+		case EOP_CONST:
+			*sp++ = (struct dual){ ins->imm, 0 };
+			break;
+		case EOP_X:
+			*sp++ = (struct dual){ x, 1 };
+			break;
+		case EOP_T:
+			*sp++ = (struct dual){ prog->t, 0 };
+			break;
+		case EOP_NEG:
+			sp[-1] = (struct dual){ -sp[-1].v, -sp[-1].d };
+			break;
+		case EOP_ADD:
+			b = *--sp;
+			sp[-1] = (struct dual){ sp[-1].v + b.v, sp[-1].d + b.d };
+			break;
+		case EOP_SUB:
+			b = *--sp;
+			sp[-1] = (struct dual){ sp[-1].v - b.v, sp[-1].d - b.d };
+			break;
+		case EOP_MUL:
+			b = *--sp;
+			a = sp[-1];
+			sp[-1] = (struct dual){ a.v * b.v, a.d * b.v + a.v * b.d };
+			break;
+		case EOP_DIV:
+			b = *--sp;
+			a = sp[-1];
+			sp[-1] = (struct dual){ a.v / b.v,
+						(a.d * b.v - a.v * b.d) /
+							(b.v * b.v) };
+			break;
+		case EOP_POW: {
+			b = *--sp;
+			a = sp[-1];
+
+			//   The terms are left out when their factor is 0, so that
+			// constant exponents keep working on negative bases.
+			const float v = powf(a.v, b.v);
+			float d = 0;
+			if (a.d != 0)
+				d += b.v * powf(a.v, b.v - 1) * a.d;
+			if (b.d != 0)
+				d += v * logf(a.v) * b.d;
+
+			sp[-1] = (struct dual){ v, d };
+			break;
+		}
+		case EOP_SIN:
+			a = sp[-1];
+			sp[-1] = (struct dual){ sinf(a.v), cosf(a.v) * a.d };
+			break;
+		case EOP_ABS:
+			a = sp[-1];
+			sp[-1] = (struct dual){ fabsf(a.v), a.v < 0 ? -a.d : a.d };
+			break;
+		case EOP_TAN: {
+			const float t = tanf(sp[-1].v);
+			sp[-1] = (struct dual){ t, (1 + t * t) * sp[-1].d };
+			break;
+		}
+		case EOP_STORE:
+			regs[ins->reg] = sp[-1];
+			break;
+		case EOP_LOAD:
+			*sp++ = regs[ins->reg];
+			break;
+		}
+	}
+
+	*dy = stack[0].d;
+	return stack[0].v;
+}
+
+//   Runs every instruction across a whole block of x values before moving on
+// to the next one. The lane loops have a fixed trip count, so the compiler
+// turns them into straight SIMD code for whichever target includes this.
+static inline __attribute__((always_inline)) void
+eval_block_poly(const struct expr_prog *prog, const float *xs, float *ys)
+{
+	double y[EXPR_BATCH];
+	for (size_t i = 0; i < EXPR_BATCH; ++i)
+		y[i] = prog->coef[prog->degree];
+
+	for (int d = prog->degree - 1; d >= 0; --d) {
+		const double c = prog->coef[d];
+		for (size_t i = 0; i < EXPR_BATCH; ++i)
+			y[i] = y[i] * xs[i] + c;
+	}
+
+	for (size_t i = 0; i < EXPR_BATCH; ++i)
+		ys[i] = (float)y[i];
+}
+
+static inline __attribute__((always_inline)) void
+eval_block(const struct expr_prog *prog, const float *xs, float *ys)
+{
+	// row 0 is never written, so sp[-1] is addressable even when empty
+	float stack[EXPR_STACK_MAX + 1][EXPR_BATCH] __attribute__((aligned(32)));
+	float (*sp)[EXPR_BATCH] = stack + 1;
+	float regs[EXPR_REGS][EXPR_BATCH] __attribute__((aligned(32)));
+
+	const struct expr_ins *ins = prog->code;
+	const struct expr_ins *end = ins + prog->len;
+
+	for (; ins < end; ++ins) {
+		float *restrict a = sp[-1];
+		const float *restrict b = sp[0];
+
+		switch (ins->op) {
+		case EOP_CONST:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				sp[0][i] = ins->imm;
+			sp++;
+			break;
+		case EOP_X:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				sp[0][i] = xs[i];
+			sp++;
+			break;
+		case EOP_T:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				sp[0][i] = prog->t;
+			sp++;
+			break;
+		case EOP_NEG:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] = -a[i];
+			break;
+		case EOP_ADD:
+			a = (--sp)[-1];
+			b = sp[0];
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] += b[i];
+			break;
+		case EOP_SUB:
+			a = (--sp)[-1];
+			b = sp[0];
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] -= b[i];
+			break;
+		case EOP_MUL:
+			a = (--sp)[-1];
+			b = sp[0];
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] *= b[i];
+			break;
+		case EOP_DIV:
+			a = (--sp)[-1];
+			b = sp[0];
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] /= b[i];
+			break;
+		case EOP_POW:
+			a = (--sp)[-1];
+			b = sp[0];
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] = powf(a[i], b[i]);
+			break;
+		case EOP_SIN:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] = sinf(a[i]);
+			break;
+		case EOP_ABS:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] = fabsf(a[i]);
+			break;
+		case EOP_TAN:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				a[i] = tanf(a[i]);
+			break;
+		case EOP_STORE:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				regs[ins->reg][i] = a[i];
+			break;
+		case EOP_LOAD:
+			for (size_t i = 0; i < EXPR_BATCH; ++i)
+				sp[0][i] = regs[ins->reg][i];
+			sp++;
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < EXPR_BATCH; ++i)
+		ys[i] = stack[1][i];
+}
+
+typedef void (*eval_batch_f)(const struct expr_prog *prog, const float *xs,
+			     float *ys, size_t n);
+
+// The tail block is padded with its last x, so every block runs full width.
+#define EVAL_BATCH_BODY                                                  \
+	for (size_t off = 0; off < n; off += EXPR_BATCH) {               \
+		const size_t m = n - off < EXPR_BATCH ? n - off : EXPR_BATCH; \
+		float xb[EXPR_BATCH], yb[EXPR_BATCH];                    \
+		for (size_t i = 0; i < EXPR_BATCH; ++i)                  \
+			xb[i] = xs[off + (i < m ? i : m - 1)];           \
+		if (prog->degree >= 0)                                   \
+			eval_block_poly(prog, xb, yb);                   \
+		else                                                     \
+			eval_block(prog, xb, yb);                        \
+		memcpy(ys + off, yb, m * sizeof *ys);                    \
+	}
+
+static void eval_batch_sse2(const struct expr_prog *prog, const float *xs,
+			    float *ys, size_t n)
+{
+	EVAL_BATCH_BODY
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static void
+eval_batch_avx2(const struct expr_prog *prog, const float *xs, float *ys,
+		size_t n)
+{
+	EVAL_BATCH_BODY
+}
+#endif
+
+static eval_batch_f pick_eval_batch(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return eval_batch_avx2;
+#endif
+	return eval_batch_sse2;
+}
+
+void expr_eval_batch(const struct expr_prog *prog, const float *xs, float *ys,
+		     size_t n)
+{
+	// graphs are sampled from more than one thread
+	static _Atomic eval_batch_f eval_batch = NULL;
+
+	eval_batch_f f = eval_batch;
+	if (f == NULL)
+		eval_batch = f = pick_eval_batch();
+
+	f(prog, xs, ys, n);
+}
+
+//   Interval arithmetic over the same program. Every result is rounded
+// outwards, by a step for the basic operations and a few for libm, so the
+// bounds hold for the exact value of the formula rather than for whatever
+// float evaluation happens to return.
+
+#define LIBM_ULPS 4
+
+static const struct expr_interval whole = { -INFINITY, INFINITY };
+
+static struct expr_interval widen(float lo, float hi, int ulps)
+{
+	for (int i = 0; i < ulps; ++i) {
+		lo = nextafterf(lo, -INFINITY);
+		hi = nextafterf(hi, INFINITY);
+	}
+
+	return (struct expr_interval){ lo, hi };
+}
+
+static struct expr_interval hull(float a, float b, float c, float d, int ulps)
+{
+	if (isnan(a) || isnan(b) || isnan(c) || isnan(d))
+		return whole;
+
+	return widen(fminf(fminf(a, b), fminf(c, d)),
+		     fmaxf(fmaxf(a, b), fmaxf(c, d)), ulps);
+}
+
+static _Bool holds_zero(struct expr_interval a)
+{
+	return a.lo <= 0 && a.hi >= 0;
+}
+
+// Whether <a> holds p + k * period for some whole k.
+static _Bool holds_phase(struct expr_interval a, double p, double period)
+{
+	const double k = ceil((a.lo - p) / period);
+	return p + k * period <= a.hi;
+}
+
+static struct expr_interval iv_mul(struct expr_interval a,
+				   struct expr_interval b)
+{
+	return hull(a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi, 1);
+}
+
+static struct expr_interval iv_div(struct expr_interval a,
+				   struct expr_interval b, _Bool *broken)
+{
+	if (holds_zero(b)) {
+		*broken = 1;
+		return whole;
+	}
+
+	return hull(a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi, 1);
+}
+
+static struct expr_interval iv_pow(struct expr_interval a,
+				   struct expr_interval b, _Bool *broken)
+{
+	const float n = b.lo;
+	const _Bool whole_power = b.lo == b.hi && n == truncf(n) &&
+				  fabsf(n) < 16777216.0F;
+
+	if (whole_power) {
+		if (n < 0 && holds_zero(a)) {
+			*broken = 1;
+			return whole;
+		}
+
+		const float p = powf(a.lo, n);
+		const float q = powf(a.hi, n);
+
+		// even powers fold the negative half over
+		if (fmodf(n, 2) == 0 && n > 0 && a.lo < 0 && a.hi > 0)
+			return hull(0, 0, p, q, LIBM_ULPS);
+
+		return hull(p, p, q, q, LIBM_ULPS);
+	}
+
+	// anything else is only defined for bases that are not negative
+	if (a.lo < 0) {
+		*broken = 1;
+		if (a.hi < 0 || b.lo != b.hi)
+			return whole;
+
+		a.lo = 0;
+	}
+
+	if (a.lo == 0 && b.lo < 0) {
+		*broken = 1;
+		return whole;
+	}
+
+	//   For a base that is not negative the power only grows or shrinks
+	// along either axis, so the corners are the extremes.
+	return hull(powf(a.lo, b.lo), powf(a.lo, b.hi), powf(a.hi, b.lo),
+		    powf(a.hi, b.hi), LIBM_ULPS);
+}
+
+static struct expr_interval iv_sin(struct expr_interval a)
+{
+	const struct expr_interval unit = { -1, 1 };
+
+	if (!isfinite(a.lo) || !isfinite(a.hi) ||
+	    (double)a.hi - a.lo >= 2 * M_PI)
+		return unit;
+
+	const float p = sinf(a.lo);
+	const float q = sinf(a.hi);
+	struct expr_interval r = hull(p, p, q, q, LIBM_ULPS);
+
+	if (holds_phase(a, M_PI / 2, 2 * M_PI))
+		r.hi = 1;
+	if (holds_phase(a, -M_PI / 2, 2 * M_PI))
+		r.lo = -1;
+
+	r.lo = fmaxf(r.lo, -1);
+	r.hi = fminf(r.hi, 1);
+	return r;
+}
+
+static struct expr_interval iv_abs(struct expr_interval a)
+{
+	if (a.lo >= 0)
+		return a;
+	if (a.hi <= 0)
+		return (struct expr_interval){ -a.hi, -a.lo };
+
+	return (struct expr_interval){ 0, fmaxf(-a.lo, a.hi) };
+}
+
+static struct expr_interval iv_tan(struct expr_interval a, _Bool *broken)
+{
+	if (!isfinite(a.lo) || !isfinite(a.hi) ||
+	    (double)a.hi - a.lo >= M_PI || holds_phase(a, M_PI / 2, M_PI)) {
+		*broken = 1;
+		return whole;
+	}
+
+	const float p = tanf(a.lo);
+	const float q = tanf(a.hi);
+	return hull(p, p, q, q, LIBM_ULPS);
+}
+
+//   Whether both operands of the binary instruction <ins> were pushed by the
+// two instructions right before it and are the same value. x * x is then
+// squared, which unlike a product of two intervals never goes negative.
+static _Bool same_operands(const struct expr_prog *prog,
+			   const struct expr_ins *ins)
+{
+	if (ins - prog->code < 2)
+		return 0;
+
+	const struct expr_ins a = ins[-2];
+	const struct expr_ins b = ins[-1];
+	return a.op == b.op && (a.op == EOP_X || a.op == EOP_T ||
+				(a.op == EOP_LOAD && a.reg == b.reg));
+}
+
+int expr_eval_interval(const struct expr_prog *prog, float x0, float x1,
+		       struct expr_interval *y)
+{
+	const struct expr_interval square = { 2, 2 };
+
+	struct expr_interval stack[EXPR_STACK_MAX];
+	struct expr_interval regs[EXPR_REGS];
+	struct expr_interval *sp = stack;
+	_Bool broken = 0;
+
+	const struct expr_ins *ins = prog->code;
+	const struct expr_ins *end = ins + prog->len;
+
+	for (; ins < end; ++ins) {
+		struct expr_interval a, b;
+
+		switch (ins->op) {
+		case EOP_CONST:
+			*sp++ = (struct expr_interval){ ins->imm, ins->imm };
+			break;
+		case EOP_X:
+			*sp++ = (struct expr_interval){ x0, x1 };
+			break;
+		case EOP_T:
+			*sp++ = (struct expr_interval){ prog->t, prog->t };
+			break;
+		case EOP_NEG:
+			a = sp[-1];
+			sp[-1] = (struct expr_interval){ -a.hi, -a.lo };
+			break;
+		case EOP_ADD:
+			b = *--sp;
+			a = sp[-1];
+			sp[-1] = hull(a.lo + b.lo, a.lo + b.lo, a.hi + b.hi,
+				      a.hi + b.hi, 1);
+			break;
+		case EOP_SUB:
+			b = *--sp;
+			a = sp[-1];
+			sp[-1] = hull(a.lo - b.hi, a.lo - b.hi, a.hi - b.lo,
+				      a.hi - b.lo, 1);
+			break;
+		case EOP_MUL:
+			b = *--sp;
+			sp[-1] = same_operands(prog, ins) ?
+					 iv_pow(b, square, &broken) :
+					 iv_mul(sp[-1], b);
+			break;
+		case EOP_DIV:
+			b = *--sp;
+			sp[-1] = iv_div(sp[-1], b, &broken);
+			break;
+		case EOP_POW:
+			b = *--sp;
+			sp[-1] = iv_pow(sp[-1], b, &broken);
+			break;
+		case EOP_SIN:
+			sp[-1] = iv_sin(sp[-1]);
+			break;
+		case EOP_ABS:
+			sp[-1] = iv_abs(sp[-1]);
+			break;
+		case EOP_TAN:
+			sp[-1] = iv_tan(sp[-1], &broken);
+			break;
+		case EOP_STORE:
+			regs[ins->reg] = sp[-1];
+			break;
+		case EOP_LOAD:
+			*sp++ = regs[ins->reg];
+			break;
+		}
+	}
+
+	*y = stack[0];
+	return broken;
+}
@@ -5,6 +5,7 @@
 #include "gameconfig.h"
 #include "gameui.h"
 #include "graph.h"
+#include "replay.h"
 
 #include "engine/render.h"
 #include "engine/physics.h"
@@ -13,6 +14,7 @@
 #include <raylib.h>
 #include <raymath.h>
 #include <string.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <malloc.h>
@@ -25,6 +27,9 @@ struct {
 	float from, to, lerp;
 } zoom;
 
+// the middle mouse nudge, handed to the next physics step
+static Vector2 nudge;
+
 static void setup_camera(void)
 {
 	game.camera.target = (Vector2){ 0.0F, 0.0F };
@@ -110,10 +115,20 @@ static void handle_input(void)
 	// }
 	// FIXME debug moving
 	if (IsMouseButtonDown(MOUSE_MIDDLE_BUTTON) && (mdx != 0 || mdy != 0)) {
-		game.player->body.linear_velocity.x += mdx;
-		game.player->body.linear_velocity.y += mdy;
+		nudge.x += mdx;
+		nudge.y += mdy;
 	}
 
+	// recording and playing back runs
+	if (IsKeyPressed(KEY_F5)) {
+		if (replay_recording())
+			replay_stop();
+		else
+			replay_record(level_number(), graph_formula());
+	}
+	if (IsKeyPressed(KEY_F6))
+		replay_play(REPLAY_FILE);
+
 	// zooming
 	// const float scroll = GetMouseWheelMove();
 	// if (scroll > 0) {
@@ -162,12 +177,35 @@ static void window_update(void)
 	game.camera.offset.y = game.window->screen_h / 2.0F;
 }
 
+//   Everything a physics step depends on is taken in here, at the step, so a
+// recorded run steps the same way when it is played back. That includes the
+// graph, which moves with level_time().
 void fixed_update(float fdt)
 {
-	window_update();
+	struct replay_input input = {
+		.nudge = nudge,
+		.paused = physics_is_paused(),
+	};
+	nudge = Vector2Zero();
+
+	const _Bool step = replay_input(&input);
+	graph_update();
+	if (!step)
+		return;
+
+	if (input.paused)
+		physics_pause();
+	else
+		physics_resume();
+
+	game.player->body.linear_velocity =
+		Vector2Add(game.player->body.linear_velocity, input.nudge);
+
+	level_tick();
 	//if (IsKeyDown(KEY_F)) {
 	physics_update(fdt);
 	//}
+	replay_check(game.player);
 }
 
 void update(void)
@@ -182,6 +220,7 @@ void update(void)
 void late_update(float dt)
 {
 	lerp_camera_zoom(dt);
+	graph_update_view();
 	//game.camera.target.x = game.player->pos.x;
 	//game.camera.target.y = game.player->pos.y;
 }
@@ -191,20 +230,41 @@ void final_update(void)
 	BeginDrawing();
 	ClearBackground(BLACK);
 
-	BeginMode2D(game.camera);
 	redraw_game();
-	EndMode2D();
 
 	redraw_ui();
 
 	EndDrawing();
 }
 
+//   Physics always steps by 1 / PHYSICS_RATE, the frame time is banked and
+// spent in whole steps. What is left over is how far the frame is drawn
+// towards the next step.
+static void step_physics(float dt)
+{
+	const float step = 1.0F / PHYSICS_RATE;
+	static float accumulator = 0;
+
+	accumulator += dt;
+
+	int steps = 0;
+	for (; accumulator >= step && steps < PHYSICS_STEPS_MAX; ++steps) {
+		fixed_update(step);
+		accumulator -= step;
+	}
+
+	if (steps == PHYSICS_STEPS_MAX && accumulator >= step)
+		accumulator = fmodf(accumulator, step);
+
+	game.alpha = accumulator / step;
+}
+
 void process_frame(void)
 {
 	const float dt = GetFrameTime();
 
-	fixed_update(dt);
+	window_update();
+	step_physics(dt);
 	update();
 	late_update(dt);
 	final_update();
@@ -5,6 +5,7 @@
 #include "engine/ui.h"
 #include "perfgoals.h"
 #include "player.h"
+#include "replay.h"
 #include <raylib.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,6 +50,9 @@ static void callback_formula_refresh(void *a)
 	if (!levelui->data->visible)
 		return;
 
+	// a new formula ends the run being recorded or played back
+	replay_stop();
+
 	struct evtbox_args *args = a;
 	build_fgraph(args->textbox->data->textbox.text.string);
 }
@@ -1,12 +1,19 @@
 #include "graph.h"
 #include "game.h"
+#include "expr.h"
+#include "player.h"
+#include "level.h"
+#include "ribbon.h"
 #include "engine/arraylist.h"
+#include "engine/arena.h"
+#include "engine/hash.h"
 #include "engine/tex.h"
 #include <malloc.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 #include <raymath.h>
 #include <rlgl.h>
 
@@ -16,6 +23,87 @@
 extern struct game game;
 
 Texture2D graphtex;
+static Material ribbon_material;
+
+struct gchunk {
+	int index;
+	_Bool ready; // 0 if the slot is free
+	float t; // the time it was sampled at
+	struct graph_samples samples;
+
+	//   The ribbon drawn over the samples, from full detail down. Only the
+	// first <nlods> levels are ever drawn, and the coarser ones are built
+	// the first time they are, <built> tells which are up to date.
+	struct ribbon lods[GRAPH_LOD_LEVELS];
+	_Bool built[GRAPH_LOD_LEVELS];
+	int nlods;
+};
+
+//   A compiled formula together with its samples. The last few graphs that
+// were built are kept, so restarting a level or going back to an earlier
+// formula only costs a lookup.
+//   Samples are kept in chunks of GRAPH_CHUNK_WIDTH that are made as the
+// camera or the player get near them and dropped once both are far away, so
+// the graph has no fixed extent.
+struct fgraph {
+	unsigned hash;
+	char *formula; // normalized, NULL if the slot is empty
+	struct expr_prog prog;
+	struct gchunk chunks[GRAPH_CHUNKS_MAX];
+	unsigned long used; // the build that last asked for this graph
+};
+
+// a range of chunk indices, both ends included
+struct span {
+	int lo, hi;
+};
+
+// normalized formulas that are played on together
+struct fset {
+	char *formulas[GRAPH_MAX];
+	size_t count;
+};
+
+//   A request to play on <set>. <graphs> holds what was compiled for it, and
+// <need> tells which formulas were not cached when it was made.
+struct fbuild {
+	struct fset set;
+	_Bool need[GRAPH_MAX];
+	struct fgraph *graphs[GRAPH_MAX];
+};
+
+static struct fgraph fgraph_cache[GRAPH_CACHE_SIZE];
+static unsigned long fgraph_builds;
+
+// the graphs being played on, in the order their formulas were given
+static struct fgraph *active[GRAPH_MAX];
+static size_t nactive;
+
+//   The samples of every active graph are gathered into one store, so drawing
+// and collision walk a single buffer whatever the number of formulas. It is
+// gathered again whenever a chunk comes or goes.
+static struct graph_samples store;
+static struct graph_run runs[GRAPH_MAX * GRAPH_CHUNKS_MAX];
+static size_t nruns;
+// the bounding trees of every run, one after the other
+static struct graph_box *boxes;
+static size_t boxes_cap;
+static _Bool store_dirty;
+// goes up every time the store is gathered
+static unsigned long store_gen;
+
+// scratch memory for compiling formulas, reset on every build
+static struct arena fgraph_arena;
+
+// The part of the world the camera sees, centered on its target.
+static Rectangle view_rect(void)
+{
+	const float w = game.window->screen_w / game.camera.zoom;
+	const float h = game.window->screen_h / game.camera.zoom;
+
+	return (Rectangle){ game.camera.target.x - w / 2,
+			    game.camera.target.y - h / 2, w, h };
+}
 
 static float scr_border_left(void)
 {
@@ -31,479 +119,879 @@ static float scr_border_right(void)
 	       game.window->screen_w / 2;
 }
 
-enum toktype {
-	TT_DEFAULT,
-	TT_UNKNOWN,
-	TT_NUM,
-	TT_X,
-	TT_OP,
-	TT_PAREN,
-	TT_FUNC,
-};
+//   The tolerance, in world units, that level <lod> of a ribbon is simplified
+// to. Each level is four times as coarse as the one before.
+static float lod_tolerance(int lod)
+{
+	return GRAPH_TOLERANCE * (float)(1 << (2 * lod));
+}
 
-enum prec {
-	PR_DEFAULT,
-	PR_ADDSUB,
-	PR_MULDIV,
-	PR_EXP,
-	PR_PAREN,
-};
+//   Level 0 is the full ribbon, the coarser ones are simplified first.
+static void build_lod(struct gchunk *c, int lod)
+{
+	const struct graph_samples *s = &c->samples;
+	c->built[lod] = 1;
 
-struct tok {
-	enum toktype type;
-	enum prec prec;
-	union {
-		float num;
-		char op;
-		char fname[8];
-	};
-};
+	if (lod == 0) {
+		ribbon_build(&c->lods[0], s, NULL, s->count);
+		return;
+	}
 
-struct node {
-	_Bool negative;
-	struct node *left, *right;
-	struct tok tok;
-};
+	size_t *keep = malloc(s->count * sizeof *keep);
+	const size_t n = graph_simplify(s, lod_tolerance(lod), keep);
+	ribbon_build(&c->lods[lod], s, keep, n);
+	free(keep);
+}
 
-struct lexer {
-	const char *s;
-	size_t i;
-};
+//   Still graphs may be drawn at every level of detail, so zooming out draws
+// fewer vertices. Moving graphs are sampled evenly and coarsely enough as it
+// is, and are only drawn at full detail. Only the full ribbon of a still
+// graph is built along with the samples. A moving one is sampled again at
+// every physics step, and its ribbon waits until it is drawn, so it is built
+// once a frame however many steps the frame took.
+static void build_lods(struct gchunk *c, _Bool timed)
+{
+	c->nlods = timed ? 1 : GRAPH_LOD_LEVELS;
+	for (int lod = 0; lod < GRAPH_LOD_LEVELS; ++lod)
+		c->built[lod] = 0;
 
-static enum toktype tt_from_char(char c)
-{
-	return c >= '0' && c <= '9' || c == '.' ? TT_NUM :
-	       c == 'x'		    ? TT_X :
-	       c >= 'a' && c <= 'z' ? TT_FUNC :
-	       c == '+' || c == '-' || c == '*' || c == '/' || c == '^' ?
-				      TT_OP :
-	       c == '(' || c == ')' ? TT_PAREN :
-				      TT_UNKNOWN;
-}
-
-static struct tok tok_from_buf(const char *buf, enum toktype tt)
-{
-	struct tok tok;
-	tok.type = tt;
-
-	switch (tt) {
-	case TT_NUM:
-		tok.num = (float)atof(buf);
-		break;
-	case TT_OP:
-	case TT_PAREN:
-		tok.op = *buf;
-		break;
-	case TT_FUNC:
-		memcpy(tok.fname, buf, strlen(buf));
-		break;
-	default:
-		break;
-	}
+	if (!timed)
+		build_lod(c, 0);
+}
+
+static void sample_chunk(const struct expr_prog *prog, struct gchunk *c)
+{
+	c->t = prog->t;
+
+	if (prog->timed)
+		graph_sample_uniform(prog, c->index, &c->samples);
+	else
+		graph_sample(prog, c->index, &c->samples);
 
-	return tok;
+	build_lods(c, prog->timed);
 }
 
-static char lex_advance(struct lexer *lex)
+static void gen_chunk(const struct expr_prog *prog, struct gchunk *c)
 {
-	return lex->s[lex->i++];
+	c->samples = (struct graph_samples){ 0 };
+	memset(c->lods, 0, sizeof c->lods);
+	c->ready = 1;
+
+	sample_chunk(prog, c);
 }
 
-static char lex_peek(struct lexer *lex, size_t by)
+static void free_chunk(struct gchunk *c)
 {
-	return lex->s[lex->i + by - 1];
+	if (!c->ready)
+		return;
+
+	graph_samples_destroy(&c->samples);
+	for (int lod = 0; lod < GRAPH_LOD_LEVELS; ++lod)
+		ribbon_free(&c->lods[lod]);
+	c->ready = 0;
 }
 
-static size_t get_prec(struct tok tok)
+static struct gchunk *find_chunk(struct fgraph *g, int index)
 {
-	switch (tok.op) {
-	case '+':
-	case '-':
-		return PR_ADDSUB;
-	case '*':
-	case '/':
-		return PR_MULDIV;
-	case '^':
-		return PR_EXP;
-	default:
-		return PR_DEFAULT;
+	for (size_t i = 0; i < GRAPH_CHUNKS_MAX; ++i) {
+		struct gchunk *c = &g->chunks[i];
+		if (c->ready && c->index == index)
+			return c;
 	}
+
+	return NULL;
 }
 
-static struct arraylist lex_expr(struct lexer *lex)
+//   The chunks covering world x from <x0> to <x1> plus the margin. Spans are
+// capped to a quarter of the slots around their middle, so that two of them
+// together with what is kept around them always fit.
+static struct span chunk_span(float x0, float x1)
 {
-	struct arraylist toks =
-		arraylist_create_preloaded(sizeof(struct tok), 32, 1);
+	struct span s = {
+		graph_chunk_index(x0) - GRAPH_CHUNK_MARGIN,
+		graph_chunk_index(x1) + GRAPH_CHUNK_MARGIN,
+	};
 
-	enum toktype search = TT_DEFAULT;
+	const int cap = GRAPH_CHUNKS_MAX / 4;
+	if (s.hi - s.lo >= cap) {
+		const int mid = s.lo + (s.hi - s.lo) / 2;
+		s.lo = mid - cap / 2;
+		s.hi = s.lo + cap - 1;
+	}
 
-	char *buffer = calloc(64, 1);
-	size_t bi = 0;
+	return s;
+}
 
-	_Bool first = 1;
+static _Bool span_keeps(struct span s, int index)
+{
+	return index >= s.lo - GRAPH_CHUNK_KEEP && index <= s.hi + GRAPH_CHUNK_KEEP;
+}
 
-	for (;;) {
-		const char c = lex_advance(lex);
+static _Bool fill_span(struct fgraph *g, struct span s)
+{
+	_Bool filled = 0;
 
-		const enum toktype tt = tt_from_char(c);
+	for (int index = s.lo; index <= s.hi; ++index) {
+		if (find_chunk(g, index) != NULL)
+			continue;
 
-		first = 0;
+		for (size_t i = 0; i < GRAPH_CHUNKS_MAX; ++i) {
+			struct gchunk *c = &g->chunks[i];
+			if (c->ready)
+				continue;
 
-		if (search == TT_DEFAULT) {
-			search = tt;
-			buffer[bi++] = c;
-			first = 1;
+			c->index = index;
+			gen_chunk(&g->prog, c);
+			filled = 1;
+			break;
 		}
+	}
 
-		const char next = lex_peek(lex, 1);
-		const enum toktype next_tt = tt_from_char(next);
-
-		if (!first)
-			buffer[bi++] = c;
+	return filled;
+}
 
-		if (next_tt != search ||
-		    (next_tt != TT_NUM && next_tt != TT_FUNC)) {
-			if (search != TT_UNKNOWN) {
-				struct tok tok = tok_from_buf(buffer, search);
-				arraylist_pushback(&toks, &tok);
-			}
+//   Moving graphs are sampled again wherever they are wanted once time has
+// moved on. The chunks kept further out go stale, and are brought up to date
+// when they are wanted again.
+static _Bool refresh_span(struct fgraph *g, struct span s)
+{
+	_Bool refreshed = 0;
 
-			search = TT_DEFAULT;
-			memset(buffer, 0, bi);
-			bi = 0;
-		}
+	for (int index = s.lo; index <= s.hi; ++index) {
+		struct gchunk *c = find_chunk(g, index);
+		if (c == NULL || c->t == g->prog.t)
+			continue;
 
-		if (next == 0)
-			break;
+		c->samples.count = 0;
+		sample_chunk(&g->prog, c);
+		refreshed = 1;
 	}
 
-	free(buffer);
-
-	return toks;
+	return refreshed;
 }
 
-static struct arraylist lex(const char *s)
+// The chunks the camera sees and the ones the player may touch.
+static void wanted_spans(struct span *view, struct span *near)
 {
-	struct lexer lex = { .s = s, .i = 0 };
-	return lex_expr(&lex);
+	const Rectangle seen = view_rect();
+	const float reach = game.player != NULL ? game.player->radius * 2 : 0;
+	const float px = game.player != NULL ? game.player->pos.x : 0;
+
+	*view = chunk_span(seen.x, seen.x + seen.width);
+	*near = chunk_span(px - reach, px + reach);
 }
 
-static struct node *newnode(struct tok tok)
+//   Samples whatever the player may touch, and whatever the camera sees if
+// <seen> is set, and drops the chunks that have fallen far outside both.
+// Returns 1 if any chunk came or went or was sampled again.
+static _Bool update_chunks(struct fgraph *g, struct span view,
+			   struct span near, _Bool seen)
 {
-	struct node *node = malloc(sizeof(struct node));
-	node->tok = tok;
-	node->negative = 0;
-	node->left = NULL;
-	node->right = NULL;
-	return node;
+	_Bool changed = 0;
+
+	for (size_t i = 0; i < GRAPH_CHUNKS_MAX; ++i) {
+		struct gchunk *c = &g->chunks[i];
+		if (c->ready && !span_keeps(view, c->index) &&
+		    !span_keeps(near, c->index)) {
+			free_chunk(c);
+			changed = 1;
+		}
+	}
+
+	if (seen)
+		changed |= fill_span(g, view);
+	changed |= fill_span(g, near);
+
+	if (g->prog.timed) {
+		if (seen)
+			changed |= refresh_span(g, view);
+		changed |= refresh_span(g, near);
+	}
+
+	return changed;
 }
 
-static void node_destroy(struct node *node)
+// a run of the store together with the chunk it is copied from
+struct source {
+	struct graph_run run;
+	const struct graph_samples *from;
+};
+
+static int compare_sources(const void *a, const void *b)
 {
-	if (node == NULL)
-		return;
+	const struct graph_run *x = &((const struct source *)a)->run;
+	const struct graph_run *y = &((const struct source *)b)->run;
+
+	if (x->chunk != y->chunk)
+		return (x->chunk > y->chunk) - (x->chunk < y->chunk);
 
-	node_destroy(node->left);
-	node_destroy(node->right);
-	free(node);
+	return (x->graph > y->graph) - (x->graph < y->graph);
 }
 
-struct parser {
-	struct arraylist tokens;
-	size_t i;
-};
+static size_t run_leaves(const struct graph_run *run)
+{
+	const size_t segs = run->count > 1 ? run->count - 1 : 0;
+	return (segs + GRAPH_LEAF - 1) / GRAPH_LEAF;
+}
+
+static size_t level_above(size_t n)
+{
+	return (n + GRAPH_FANOUT - 1) / GRAPH_FANOUT;
+}
 
-static struct tok parser_advance(struct parser *par)
+static size_t tree_size(size_t leaves)
 {
-	struct tok *tok = arraylist_get(&par->tokens, par->i++);
-	return *tok;
+	size_t total = leaves;
+	for (size_t n = leaves; n > 1; total += n)
+		n = level_above(n);
+
+	return total;
 }
 
-static struct tok parser_peek(struct parser *par, size_t by)
+static void box_merge(struct graph_box *box, struct graph_box with)
 {
-	struct tok *tok = arraylist_get(&par->tokens, par->i + by - 1);
-	return *tok;
+	box->left = fminf(box->left, with.left);
+	box->right = fmaxf(box->right, with.right);
+	box->top = fminf(box->top, with.top);
+	box->bottom = fmaxf(box->bottom, with.bottom);
 }
 
-struct node *parse_expr(struct parser *par, enum prec min_prec);
+static const struct graph_box empty_box = { INFINITY, -INFINITY, INFINITY,
+					    -INFINITY };
 
-static struct node *parse_primary(struct parser *par)
+//   The leaves come first and bound their segments' samples, including the
+// one they share with the next leaf, and every level above follows the one
+// below it. The root is last. fminf() and fmaxf() pass over the NaNs of
+// breaks, so a leaf of only breaks is empty and meets nothing.
+static void build_tree(struct graph_run *run)
 {
-	struct tok tok = parser_advance(par);
-	struct tok next = parser_peek(par, 1);
+	struct graph_box *node = boxes + run->tree;
+	const size_t end = run->start + run->count;
+	size_t n = run_leaves(run);
+
+	for (size_t j = 0; j < n; ++j, ++node) {
+		const size_t first = run->start + j * GRAPH_LEAF;
+		const size_t last =
+			first + GRAPH_LEAF < end ? first + GRAPH_LEAF : end - 1;
+
+		*node = empty_box;
+		for (size_t i = first; i <= last; ++i) {
+			const float x = store.x[i], y = store.y[i];
+			box_merge(node, (struct graph_box){ x, x, y, y });
+		}
+	}
+
+	const struct graph_box *below = boxes + run->tree;
+	while (n > 1) {
+		const size_t up = level_above(n);
 
-	if (tok.type == TT_FUNC && next.type == TT_PAREN && next.op == '(') {
-		struct node *f = newnode(tok);
-		parser_advance(par);
-		f->left = parse_expr(par, PR_DEFAULT);
-		parser_advance(par);
-		return f;
+		for (size_t j = 0; j < up; ++j, ++node) {
+			*node = empty_box;
+			for (size_t k = j * GRAPH_FANOUT;
+			     k < n && k < (j + 1) * GRAPH_FANOUT; ++k)
+				box_merge(node, below[k]);
+		}
+
+		below += n;
+		n = up;
 	}
 
-	if (tok.type == TT_PAREN && tok.op == '(') {
-		struct node *node = parse_expr(par, PR_DEFAULT);
-		parser_advance(par);
-		return node;
+	const struct graph_box root = n > 0 ? node[-1] : empty_box;
+	run->top = root.top;
+	run->bottom = root.bottom;
+}
+
+//   Lays the chunks of every active graph out in the store, ordered by chunk
+// and then by graph, and builds a bounding tree over each run.
+static void gather_store(void)
+{
+	static struct source sources[GRAPH_MAX * GRAPH_CHUNKS_MAX];
+	size_t total = 0;
+	nruns = 0;
+
+	for (size_t k = 0; k < nactive; ++k) {
+		for (size_t i = 0; i < GRAPH_CHUNKS_MAX; ++i) {
+			const struct gchunk *c = &active[k]->chunks[i];
+			if (!c->ready)
+				continue;
+
+			sources[nruns++] = (struct source){
+				.run.chunk = c->index,
+				.run.graph = (unsigned)k,
+				.run.count = c->samples.count,
+				.from = &c->samples,
+			};
+			total += c->samples.count;
+		}
 	}
 
-	struct tok prev = par->i == 1 ? (struct tok){ .op = TT_OP } : parser_peek(par, -1);
-	const _Bool negative = prev.type == TT_OP && tok.type == TT_OP &&
-			       tok.op == '-' &&
-			       (next.type == TT_NUM || next.type == TT_X);
+	qsort(sources, nruns, sizeof *sources, compare_sources);
 
-	if (negative) {
-		tok = parser_advance(par);
-		next = parser_peek(par, 1);
+	store.count = 0;
+	graph_samples_reserve(&store, total);
+
+	size_t nboxes = 0;
+	for (size_t r = 0; r < nruns; ++r)
+		nboxes += tree_size(run_leaves(&sources[r].run));
+
+	if (nboxes > boxes_cap) {
+		boxes_cap = nboxes;
+		boxes = realloc(boxes, boxes_cap * sizeof *boxes);
 	}
 
-	if (next.type == TT_X) {
-		struct node *mul = newnode((struct tok){ .type = TT_OP, .op = '*' });
-		mul->left = newnode(tok);
-		mul->left->negative = negative;
-		mul->right = newnode(parser_advance(par));
-		return mul;
+	nboxes = 0;
+	for (size_t r = 0; r < nruns; ++r) {
+		struct graph_run *run = &runs[r];
+		const struct graph_samples *from = sources[r].from;
+		*run = sources[r].run;
+
+		const size_t n = from->count;
+		run->start = store.count;
+		memcpy(store.x + store.count, from->x, n * sizeof *store.x);
+		memcpy(store.y + store.count, from->y, n * sizeof *store.y);
+		memcpy(store.nx + store.count, from->nx, n * sizeof *store.nx);
+		memcpy(store.ny + store.count, from->ny, n * sizeof *store.ny);
+		store.count += n;
+
+		run->tree = nboxes;
+		nboxes += tree_size(run_leaves(run));
+		build_tree(run);
 	}
 
-	struct node *node = newnode(tok);
-	node->negative = negative;
-	return node;
+	store_dirty = 0;
+	store_gen++;
 }
 
-struct node *parse_expr(struct parser *par, enum prec min_prec)
+//   Keeps the chunks of every active graph in step with the player and the
+// time, and with the camera too if <seen> is set, and gathers the store again
+// if any of them changed.
+static void update_active(_Bool seen)
 {
-	struct node *left = parse_primary(par);
+	struct span view, near;
+	wanted_spans(&view, &near);
 
-	size_t tok_count = arraylist_count(&par->tokens);
-	struct tok tok_next;
-	for (; par->i < tok_count;) {
-		tok_next = parser_peek(par, 1);
+	const float t = level_time();
 
-		if ((tok_next.type == TT_PAREN && tok_next.op == ')'))
-			break;
+	for (size_t k = 0; k < nactive; ++k) {
+		active[k]->prog.t = t;
+		store_dirty |= update_chunks(active[k], view, near, seen);
+	}
 
-		struct tok op_tok = tok_next;
-		enum prec op_prec = get_prec(op_tok);
+	if (store_dirty)
+		gather_store();
+}
 
-		if (op_prec < min_prec)
-			break;
+static struct fgraph *fgraph_lookup(unsigned hash, const char *formula)
+{
+	for (size_t i = 0; i < GRAPH_CACHE_SIZE; ++i) {
+		struct fgraph *g = &fgraph_cache[i];
+		if (g->formula != NULL && g->hash == hash &&
+		    strcmp(g->formula, formula) == 0)
+			return g;
+	}
+
+	return NULL;
+}
 
-		parser_advance(par);
+// Returns an empty slot if there is one, else the least recently used graph.
+static struct fgraph *fgraph_victim(void)
+{
+	struct fgraph *victim = &fgraph_cache[0];
 
-		struct node *right = parse_expr(par, op_prec + 1);
+	for (size_t i = 0; i < GRAPH_CACHE_SIZE; ++i) {
+		struct fgraph *g = &fgraph_cache[i];
+		if (g->formula == NULL)
+			return g;
 
-		struct node *bin = newnode(op_tok);
-		bin->left = left;
-		bin->right = right;
-		left = bin;
+		if (g->used < victim->used)
+			victim = g;
 	}
 
-	return left;
+	return victim;
 }
 
-static struct node *parse(struct arraylist tokens)
+static void fgraph_evict(struct fgraph *g)
 {
-	struct parser par = { .tokens = tokens, .i = 0 };
-	return parse_expr(&par, PR_DEFAULT);
+	if (g->formula == NULL)
+		return;
+
+	free(g->formula);
+	expr_destroy(&g->prog);
+
+	for (size_t i = 0; i < GRAPH_CHUNKS_MAX; ++i)
+		free_chunk(&g->chunks[i]);
+
+	memset(g, 0, sizeof *g);
 }
 
-static void view_toklist(struct arraylist *toks)
+//   Compiles <formula> and samples the given spans of it at time <t> into a
+// new graph. Returns NULL if it does not compile. This only touches the graph
+// it builds and the compiler's arena, so it runs on the worker thread.
+static struct fgraph *fgraph_build(const char *formula, float t,
+				   struct span view, struct span near)
 {
-	printf("token list: ");
-	for (size_t i = 0; i < arraylist_count(toks); ++i) {
-		struct tok *tok = arraylist_get(toks, i);
-		printf("{ t: %d, v: %f (%c) } ", tok->type, tok->num, tok->op);
+	arena_reset(&fgraph_arena);
+
+	struct expr_prog prog;
+	if (expr_compile(&prog, formula, &fgraph_arena) < 0) {
+		printf("formula \"%s\" is too complex to compile.\n", formula);
+		return NULL;
 	}
-	printf("\n");
+
+	// refining evaluates one x at a time, where native code pays off most
+	expr_jit(&prog);
+	prog.t = t;
+
+	struct fgraph *g = calloc(1, sizeof *g);
+	g->hash = hash_str(formula);
+	g->formula = strdup(formula);
+	g->prog = prog;
+
+	fill_span(g, view);
+	fill_span(g, near);
+
+	return g;
 }
 
-static void rview_nodes(struct node *node, size_t depth)
+static void drop_graph(struct fgraph *g)
 {
-	printf("([%lu] %d, %f (%c), neg: %d)", depth, node->tok.type, node->tok.num,
-	       node->tok.op, node->negative);
-	if (node->left != NULL && node->right != NULL) {
-		printf("{ L: ");
-		rview_nodes(node->left, depth + 1);
-		printf(", R: ");
-		rview_nodes(node->right, depth + 1);
-		printf(" }");
-	}
+	if (g == NULL)
+		return;
+
+	fgraph_evict(g);
+	free(g);
 }
 
-static void view_nodes(struct node *root)
+//   Splits <expr> at GRAPH_SEPARATOR into normalized formulas, leaving out the
+// empty ones and repeats. Formulas past the first GRAPH_MAX are ignored.
+static void fset_parse(struct fset *set, const char *expr)
 {
-	rview_nodes(root, 0);
-	printf("\n");
-}
+	const char separator[] = { GRAPH_SEPARATOR, 0 };
+	set->count = 0;
+
+	while (set->count < GRAPH_MAX) {
+		const size_t len = strcspn(expr, separator);
+
+		char *part = malloc(len + 1);
+		memcpy(part, expr, len);
+		part[len] = 0;
+
+		char *formula = malloc(len + 1);
+		_Bool keep = expr_normalize(formula, part) != 0;
+		free(part);
+
+		for (size_t i = 0; keep && i < set->count; ++i)
+			keep = strcmp(set->formulas[i], formula) != 0;
 
-static float calculate_for_x(struct node *node, float x);
+		if (keep)
+			set->formulas[set->count++] = formula;
+		else
+			free(formula);
 
-static float calc_func(struct node *node, float x)
+		if (expr[len] == 0)
+			break;
+
+		expr += len + 1;
+	}
+}
+
+static void fbuild_free(struct fbuild *b)
 {
-	const float v = calculate_for_x(node->left, x);
+	if (b == NULL)
+		return;
 
-	if (strcmp(node->tok.fname, "sin") == 0)
-		return sinf(v);
-	if (strcmp(node->tok.fname, "abs") == 0)
-		return fabsf(x);
-	if (strcmp(node->tok.fname, "tan") == 0)
-		return tanf(x);
+	for (size_t i = 0; i < b->set.count; ++i) {
+		free(b->set.formulas[i]);
+		drop_graph(b->graphs[i]);
+	}
 
-	return 0;
+	free(b);
 }
 
-static float calculate_for_x(struct node *node, float x)
+//   Makes the formulas of <b> the ones being played on, moving the graphs
+// built for it into the cache. The cached ones are claimed first, and the
+// cache holds at least twice GRAPH_MAX graphs, so installing the others
+// never evicts them.
+static void fbuild_use(struct fbuild *b)
 {
-	if (node == NULL)
-		return -x;
+	const unsigned long stamp = ++fgraph_builds;
+	struct fgraph *graphs[GRAPH_MAX] = { 0 };
 
-	const struct tok tok = node->tok;
+	for (size_t i = 0; i < b->set.count; ++i) {
+		const char *formula = b->set.formulas[i];
+		if (b->graphs[i] != NULL)
+			continue;
 
-	//printf("nt: %d, x: %f\n", node->tok.type, x);
+		graphs[i] = fgraph_lookup(hash_str(formula), formula);
+		if (graphs[i] != NULL)
+			graphs[i]->used = stamp;
+	}
 
-	switch (node->tok.type) {
-	case TT_OP: {
-		const float left = calculate_for_x(node->left, x);
-		const float right = calculate_for_x(node->right, x);
+	for (size_t i = 0; i < b->set.count; ++i) {
+		if (b->graphs[i] == NULL)
+			continue;
 
-		if (tok.op == '+')
-			return left + right;
-		if (tok.op == '-')
-			return left - right;
-		if (tok.op == '*')
-			return left * right;
-		if (tok.op == '/')
-			return left / right;
-		if (tok.op == '^')
-			return powf(left, right);
+		struct fgraph *g = fgraph_victim();
+		fgraph_evict(g);
 
-		return 0;
+		*g = *b->graphs[i];
+		g->used = stamp;
+		free(b->graphs[i]);
+		b->graphs[i] = NULL;
+		graphs[i] = g;
 	}
-	case TT_NUM:
-		return node->negative ? -node->tok.num : node->tok.num;
-	case TT_X:
-		return node->negative ? -x : x;
-	case TT_FUNC:
-		return calc_func(node, x);
-	default:
-		return 0;
+
+	nactive = 0;
+	for (size_t i = 0; i < b->set.count; ++i) {
+		if (graphs[i] != NULL)
+			active[nactive++] = graphs[i];
 	}
+
+	store_dirty = 1;
+	update_active(1);
 }
 
-static struct arraylist gen_gpoints(struct node *ast)
+//   Formulas that are not cached are compiled and sampled on a worker thread,
+// so editing them never stalls a frame. The finished build waits in <done>
+// until graph_update() swaps it in at the next physics step, so
+// rendering and physics only ever see complete graphs.
+//   Every request bumps <gen>, and a build made for an older one is thrown
+// away rather than swapped in over what was asked for since.
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	struct fbuild *job; // NULL if there is nothing to build
+	struct span view, near;
+	float t;
+	unsigned long gen;
+
+	struct fbuild *done;
+	unsigned long done_gen;
+
+	// the last request that is in place, or that failed to build
+	unsigned long settled_gen;
+	// what the last request asked for
+	char *formula;
+} worker = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static void *worker_main(void *arg)
 {
-	const size_t n = 5000;
+	(void)arg;
+
+	pthread_mutex_lock(&worker.lock);
+
+	for (;;) {
+		while (worker.job == NULL)
+			pthread_cond_wait(&worker.wake, &worker.lock);
+
+		struct fbuild *b = worker.job;
+		const struct span view = worker.view;
+		const struct span near = worker.near;
+		const float t = worker.t;
+		const unsigned long gen = worker.gen;
+		worker.job = NULL;
+
+		pthread_mutex_unlock(&worker.lock);
+
+		// one formula that does not compile keeps the whole set out
+		_Bool ok = 1;
+		for (size_t i = 0; ok && i < b->set.count; ++i) {
+			if (!b->need[i])
+				continue;
+
+			b->graphs[i] = fgraph_build(b->set.formulas[i], t,
+						    view, near);
+			ok = b->graphs[i] != NULL;
+		}
 
-	struct arraylist points =
-		arraylist_create_preloaded(sizeof(Vector2), n, 1);
+		pthread_mutex_lock(&worker.lock);
 
-	for (size_t i = 0; i < n; ++i) {
-		float x = ((float)i - (float)n / 2) / GRAPH_SCALE;
-		float y = calculate_for_x(ast, x);
+		if (!ok || gen != worker.gen) {
+			if (gen == worker.gen)
+				worker.settled_gen = gen;
 
-		x *= GRAPH_SCALE;
-		y *= GRAPH_SCALE;
+			fbuild_free(b);
+			continue;
+		}
 
-		const Vector2 p = { x, y };
-		arraylist_pushback(&points, &p);
+		fbuild_free(worker.done);
+		worker.done = b;
+		worker.done_gen = gen;
 	}
 
-	return points;
+	return NULL;
 }
 
 void build_fgraph(const char *expr)
 {
-	struct arraylist tokens = lex(expr);
-	view_toklist(&tokens);
+	struct fbuild *b = calloc(1, sizeof *b);
+	fset_parse(&b->set, expr);
+
+	_Bool cached = 1;
+	for (size_t i = 0; i < b->set.count; ++i) {
+		const char *formula = b->set.formulas[i];
+		b->need[i] = fgraph_lookup(hash_str(formula), formula) == NULL;
+		cached &= !b->need[i];
+	}
+
+	pthread_mutex_lock(&worker.lock);
 
-	struct node *ast = parse(tokens);
-	view_nodes(ast);
+	// whatever was asked for before is stale now
+	worker.gen++;
+	fbuild_free(worker.job);
+	worker.job = NULL;
 
-	//const float x = 5;
-	//const float y = calculate_for_x(ast, x);
-	//printf("expr:\"%s\" with x:%f -> y:%f\n", expr, x, y);
+	free(worker.formula);
+	worker.formula = strdup(expr);
 
-	if (game.graph_points.data != NULL)
-		arraylist_destroy(&game.graph_points);
+	if (cached) {
+		worker.settled_gen = worker.gen;
+		pthread_mutex_unlock(&worker.lock);
+		fbuild_use(b);
+		fbuild_free(b);
+		return;
+	}
 
-	game.graph_points = gen_gpoints(ast);
+	worker.job = b;
+	wanted_spans(&worker.view, &worker.near);
+	worker.t = level_time();
+	pthread_cond_signal(&worker.wake);
+	pthread_mutex_unlock(&worker.lock);
 }
 
-static void draw_line(Vector2 a, Vector2 b, Color c)
+void graph_update(void)
 {
-	a.y = -a.y;
-	b.y = -b.y;
-	DrawLineV(a, b, c);
+	pthread_mutex_lock(&worker.lock);
+	struct fbuild *done = worker.done;
+	const _Bool current = worker.done_gen == worker.gen;
+	worker.done = NULL;
+	if (done != NULL && current)
+		worker.settled_gen = worker.gen;
+	pthread_mutex_unlock(&worker.lock);
+
+	if (done != NULL && current)
+		fbuild_use(done);
+	else
+		update_active(0);
+
+	fbuild_free(done);
 }
 
-void render_graph(void)
+void graph_update_view(void)
 {
-	struct arraylist *points = &game.graph_points;
+	update_active(1);
+}
 
-	const Vector2 *vpoints = points->data;
-	if (vpoints == NULL)
-		return;
+_Bool graph_pending(void)
+{
+	pthread_mutex_lock(&worker.lock);
+	const _Bool pending = worker.settled_gen != worker.gen;
+	pthread_mutex_unlock(&worker.lock);
 
-	const float width = 5;
+	return pending;
+}
+
+const char *graph_formula(void)
+{
+	return worker.formula != NULL ? worker.formula : "";
+}
 
-	_Bool tangent_set = 0;
-	Vector2 prev = vpoints[0];
-	Vector2 prev_tan = { 0 };
-	float prev_v = 0;
+unsigned long graph_generation(void)
+{
+	return store_gen;
+}
 
-	for (size_t i = 1; i < arraylist_count(points); ++i) {
-		Vector2 point = vpoints[i];
-		point.y = -point.y;
+const struct graph_samples *graph_store(void)
+{
+	return &store;
+}
 
-		// Vector from previous to current
-		Vector2 delta = { point.x - prev.x, point.y - prev.y };
+const struct graph_run *graph_runs(int lo, int hi, size_t *count)
+{
+	// the first run at or after chunk <lo>
+	size_t first = 0, last = nruns;
+	while (first < last) {
+		const size_t mid = first + (last - first) / 2;
+		if (runs[mid].chunk < lo)
+			first = mid + 1;
+		else
+			last = mid;
+	}
 
-		// The right hand normal to the delta vector
-		Vector2 normal =
-			Vector2Normalize((Vector2){ -delta.y, delta.x });
+	size_t end = first;
+	while (end < nruns && runs[end].chunk <= hi)
+		end++;
 
-		// The v texture coordinate of the segment (add up the length of all the segments so far)
-		const float v = prev_v + Vector2Length(delta);
+	*count = end - first;
+	return &runs[first];
+}
 
-		// Make sure the start point has a normal
-		if (!tangent_set) {
-			prev_tan = normal;
-			tangent_set = 1;
+static _Bool boxes_meet(struct graph_box a, struct graph_box b)
+{
+	return a.left <= b.right && b.left <= a.right && a.top <= b.bottom &&
+	       b.top <= a.bottom;
+}
+
+void graph_query_begin(struct graph_query *q, const struct graph_run *run,
+		       struct graph_box box)
+{
+	q->run = run;
+	q->box = box;
+	q->top = 0;
+
+	size_t n = run_leaves(run);
+	if (n == 0)
+		return;
+
+	unsigned levels = 1;
+	q->offset[0] = run->tree;
+	for (; n > 1; n = level_above(n)) {
+		q->offset[levels] = q->offset[levels - 1] + n;
+		levels++;
+	}
+
+	q->stack[0] = 0;
+	q->level[0] = (unsigned char)(levels - 1);
+	q->top = 1;
+}
+
+_Bool graph_query_next(struct graph_query *q, size_t *first, size_t *last)
+{
+	const size_t leaves = run_leaves(q->run);
+
+	while (q->top > 0) {
+		q->top--;
+		const size_t index = q->stack[q->top];
+		const unsigned level = q->level[q->top];
+
+		if (!boxes_meet(boxes[q->offset[level] + index], q->box))
+			continue;
+
+		if (level == 0) {
+			const size_t end = q->run->start + q->run->count;
+			*first = q->run->start + index * GRAPH_LEAF;
+			*last = *first + GRAPH_LEAF < end ? *first + GRAPH_LEAF :
+							    end - 1;
+			return 1;
+		}
+
+		// the children go on the stack right to left, so that the
+		// leftmost comes off first
+		size_t below = leaves;
+		for (unsigned l = 1; l < level; ++l)
+			below = level_above(below);
+
+		size_t child = (index + 1) * GRAPH_FANOUT;
+		if (child > below)
+			child = below;
+
+		while (child-- > index * GRAPH_FANOUT) {
+			q->stack[q->top] = child;
+			q->level[q->top] = (unsigned char)(level - 1);
+			q->top++;
 		}
+	}
+
+	return 0;
+}
+
+Vector2 graph_normal(unsigned graph, float x)
+{
+	if (graph >= nactive)
+		return (Vector2){ 0, -1 };
+
+	float dy;
+	expr_eval_dual(&active[graph]->prog, x / GRAPH_SCALE, &dy);
+	return graph_slope_normal(dy);
+}
+
+static void draw_line(Vector2 a, Vector2 b, Color c)
+{
+	a.y = -a.y;
+	b.y = -b.y;
+	DrawLineV(a, b, c);
+}
+
+//   The coarsest level of detail of <c> that strays no more than
+// GRAPH_LOD_ERROR pixels from its samples at the camera's zoom.
+static int lod_level(const struct gchunk *c)
+{
+	int lod = 0;
+	while (lod + 1 < c->nlods &&
+	       lod_tolerance(lod + 1) * game.camera.zoom <= GRAPH_LOD_ERROR)
+		lod++;
+
+	return lod;
+}
+
+//   The ribbon of <c> for the camera's zoom, built here the first time it is
+// asked for since the chunk was sampled. The camera stays at a zoom of 1 for
+// now, which is always drawn at full detail, so the coarser levels wait for
+// the zoom to change.
+static struct ribbon *lod_ribbon(struct gchunk *c)
+{
+	const int lod = lod_level(c);
+	if (!c->built[lod])
+		build_lod(c, lod);
 
-		// Extend out the normals from the previous and current points to get the quad for this segment
-		Vector2 prevPosNormal =
-			Vector2Add(prev, Vector2Scale(prev_tan, width));
-		Vector2 prevNegNormal =
-			Vector2Add(prev, Vector2Scale(prev_tan, -width));
+	return &c->lods[lod];
+}
+
+// The box a run's ribbon is drawn in, empty if the run holds only breaks.
+static Rectangle run_box(const struct graph_run *run)
+{
+	if (run->top > run->bottom)
+		return (Rectangle){ 0 };
+
+	return (Rectangle){
+		(float)run->chunk * GRAPH_CHUNK_WIDTH - RIBBON_WIDTH,
+		run->top - RIBBON_WIDTH,
+		GRAPH_CHUNK_WIDTH + 2 * RIBBON_WIDTH,
+		run->bottom - run->top + 2 * RIBBON_WIDTH,
+	};
+}
 
-		Vector2 currentPosNormal =
-			Vector2Add(point, Vector2Scale(normal, width));
-		Vector2 currentNegNormal =
-			Vector2Add(point, Vector2Scale(normal, -width));
+//   Every chunk of every graph is one draw of its ribbon, at the level of
+// detail the zoom calls for, and only the chunks whose box meets the
+// camera's view are drawn. Whatever was batched before
+// has to be drawn first so that it stays underneath, and culling is off
+// because the flipped camera turns the winding around.
+void render_graph(void)
+{
+	const Rectangle seen = view_rect();
 
-		// Draw the segment as a quad
-		rlSetTexture(graphtex.id);
-		rlBegin(RL_QUADS);
-		rlColor4ub(255, 255, 255, 255);
-		rlNormal3f(0.0F, 0.0F, 1.0F);
+	size_t count;
+	const struct graph_run *runs =
+		graph_runs(graph_chunk_index(seen.x),
+			   graph_chunk_index(seen.x + seen.width), &count);
 
-		rlTexCoord2f(0, prev_v);
-		rlVertex2f(prevNegNormal.x, prevNegNormal.y);
+	_Bool flushed = 0;
 
-		rlTexCoord2f(1, prev_v);
-		rlVertex2f(prevPosNormal.x, prevPosNormal.y);
+	for (size_t r = 0; r < count; ++r) {
+		const Rectangle box = run_box(&runs[r]);
+		if (box.width == 0 || !CheckCollisionRecs(box, seen))
+			continue;
 
-		rlTexCoord2f(1, v);
-		rlVertex2f(currentPosNormal.x, currentPosNormal.y);
+		struct fgraph *g = active[runs[r].graph];
+		struct gchunk *c = find_chunk(g, runs[r].chunk);
+		if (c == NULL)
+			continue;
 
-		rlTexCoord2f(0, v);
-		rlVertex2f(currentNegNormal.x, currentNegNormal.y);
-		rlEnd();
+		if (!flushed) {
+			rlDrawRenderBatchActive();
+			rlDisableBackfaceCulling();
+			flushed = 1;
+		}
 
-		prev = point;
-		prev_v = v;
-		prev_tan = normal;
+		ribbon_draw(lod_ribbon(c), ribbon_material, g->prog.timed);
 	}
+
+	if (flushed)
+		rlEnableBackfaceCulling();
 }
 
 void render_fgraph_old(float (*f)(float x), Color color)
@@ -538,6 +1026,15 @@ void render_fgraph_old(float (*f)(float x), Color color)
 
 void graph_init(void)
 {
+	fgraph_arena = arena_create(16 * 1024);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, worker_main, NULL);
+	pthread_detach(thread);
+
 	texture_load(&graphtex, "res/img/graphline.png");
 	SetTextureFilter(graphtex, TEXTURE_FILTER_BILINEAR);
+
+	ribbon_material = LoadMaterialDefault();
+	SetMaterialTexture(&ribbon_material, MATERIAL_MAP_DIFFUSE, graphtex);
 }
@@ -0,0 +1,252 @@
+#include "expr.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define USE_JIT 1
+
+//   A small x86-64 code generator for compiled formulas. Each program becomes
+// a native `float f(float x, float t)` following the System V calling
+// convention. The top of the value stack lives in xmm0 and everything below
+// it is spilled to fixed slots in the frame, so the generated code is a
+// straight line of SSE scalar instructions with calls into libm for the
+// transcendental functions.
+//   Anything that is not x86-64 on a unix-like system keeps using the
+// bytecode interpreter.
+
+#if USE_JIT && defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// the most bytes a single bytecode instruction can expand to
+#define MAX_INS_BYTES 32
+
+struct jitbuf {
+	uint8_t *code;
+	size_t len;
+};
+
+static void put(struct jitbuf *b, const void *bytes, size_t n)
+{
+	memcpy(b->code + b->len, bytes, n);
+	b->len += n;
+}
+
+static void put_u8(struct jitbuf *b, uint8_t v)
+{
+	put(b, &v, 1);
+}
+
+static void put_u32(struct jitbuf *b, uint32_t v)
+{
+	put(b, &v, 4);
+}
+
+static void put_u64(struct jitbuf *b, uint64_t v)
+{
+	put(b, &v, 8);
+}
+
+// <op> xmm<reg>, [rsp + disp32] with the scalar single (F3) prefix
+static void sse_mem(struct jitbuf *b, uint8_t op, uint8_t reg, uint32_t disp)
+{
+	const uint8_t ins[] = { 0xF3, 0x0F, op, 0x84 | (reg << 3), 0x24 };
+	put(b, ins, sizeof ins);
+	put_u32(b, disp);
+}
+
+// <op> xmm0, xmm1 with the given prefix (0 for none)
+static void sse_rr(struct jitbuf *b, uint8_t prefix, uint8_t op)
+{
+	if (prefix != 0)
+		put_u8(b, prefix);
+
+	const uint8_t ins[] = { 0x0F, op, 0xC1 };
+	put(b, ins, sizeof ins);
+}
+
+// mov eax, imm32; movd xmm<reg>, eax
+static void load_bits(struct jitbuf *b, uint8_t reg, uint32_t bits)
+{
+	put_u8(b, 0xB8);
+	put_u32(b, bits);
+
+	const uint8_t movd[] = { 0x66, 0x0F, 0x6E, 0xC0 | (reg << 3) };
+	put(b, movd, sizeof movd);
+}
+
+// movss xmm1, xmm0
+static void tos_to_xmm1(struct jitbuf *b)
+{
+	const uint8_t ins[] = { 0xF3, 0x0F, 0x10, 0xC8 };
+	put(b, ins, sizeof ins);
+}
+
+// mov rax, imm64; call rax
+static void call(struct jitbuf *b, uintptr_t f)
+{
+	const uint8_t mov[] = { 0x48, 0xB8 };
+	put(b, mov, sizeof mov);
+	put_u64(b, (uint64_t)f);
+
+	const uint8_t ins[] = { 0xFF, 0xD0 };
+	put(b, ins, sizeof ins);
+}
+
+static void rsp_adjust(struct jitbuf *b, uint8_t modrm, uint32_t by)
+{
+	const uint8_t ins[] = { 0x48, 0x81, modrm };
+	put(b, ins, sizeof ins);
+	put_u32(b, by);
+}
+
+#define MOVSS_LOAD 0x10
+#define MOVSS_STORE 0x11
+#define ADDSS 0x58
+#define MULSS 0x59
+#define SUBSS 0x5C
+#define DIVSS 0x5E
+#define ANDPS 0x54
+#define XORPS 0x57
+
+static void emit_program(struct jitbuf *b, const struct expr_prog *prog)
+{
+	// slot i holds stack entry i, x and t sit right after the deepest slot
+	// and the registers follow them
+	const uint32_t xslot = (uint32_t)(4 * prog->depth);
+	const uint32_t tslot = xslot + 4;
+	const uint32_t regs = tslot + 4;
+
+	// rsp is 8 off a 16 byte boundary on entry and must be aligned at calls
+	const uint32_t frame =
+		(regs + (uint32_t)(4 * prog->nregs) + 15) / 16 * 16 + 8;
+
+	rsp_adjust(b, 0xEC, frame); // sub rsp, frame
+	sse_mem(b, MOVSS_STORE, 0, xslot);
+	sse_mem(b, MOVSS_STORE, 1, tslot);
+
+	size_t sp = 0;
+
+	for (size_t i = 0; i < prog->len; ++i) {
+		const struct expr_ins ins = prog->code[i];
+		const uint32_t below = (uint32_t)(4 * (sp >= 2 ? sp - 2 : 0));
+
+		switch (ins.op) {
+		case EOP_CONST:
+		case EOP_X:
+		case EOP_T:
+		case EOP_LOAD:
+			if (sp > 0)
+				sse_mem(b, MOVSS_STORE, 0, (uint32_t)(4 * (sp - 1)));
+
+			if (ins.op == EOP_X) {
+				sse_mem(b, MOVSS_LOAD, 0, xslot);
+			} else if (ins.op == EOP_T) {
+				sse_mem(b, MOVSS_LOAD, 0, tslot);
+			} else if (ins.op == EOP_LOAD) {
+				sse_mem(b, MOVSS_LOAD, 0, regs + 4 * ins.reg);
+			} else {
+				uint32_t bits;
+				memcpy(&bits, &ins.imm, sizeof bits);
+				load_bits(b, 0, bits);
+			}
+
+			sp++;
+			break;
+		case EOP_STORE:
+			sse_mem(b, MOVSS_STORE, 0, regs + 4 * ins.reg);
+			break;
+		case EOP_NEG:
+			load_bits(b, 1, 0x80000000U);
+			sse_rr(b, 0, XORPS);
+			break;
+		case EOP_ABS:
+			load_bits(b, 1, 0x7FFFFFFFU);
+			sse_rr(b, 0, ANDPS);
+			break;
+		case EOP_ADD:
+			sse_mem(b, ADDSS, 0, below);
+			sp--;
+			break;
+		case EOP_MUL:
+			sse_mem(b, MULSS, 0, below);
+			sp--;
+			break;
+		case EOP_SUB:
+		case EOP_DIV:
+			tos_to_xmm1(b);
+			sse_mem(b, MOVSS_LOAD, 0, below);
+			sse_rr(b, 0xF3, ins.op == EOP_SUB ? SUBSS : DIVSS);
+			sp--;
+			break;
+		case EOP_POW:
+			tos_to_xmm1(b);
+			sse_mem(b, MOVSS_LOAD, 0, below);
+			call(b, (uintptr_t)&powf);
+			sp--;
+			break;
+		case EOP_SIN:
+			call(b, (uintptr_t)&sinf);
+			break;
+		case EOP_TAN:
+			call(b, (uintptr_t)&tanf);
+			break;
+		}
+	}
+
+	rsp_adjust(b, 0xC4, frame); // add rsp, frame
+	put_u8(b, 0xC3); // ret
+}
+
+int expr_jit(struct expr_prog *prog)
+{
+	expr_jit_release(prog);
+
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t need = (prog->len + 4) * MAX_INS_BYTES;
+	const size_t size = (need + page - 1) / page * page;
+
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+
+	struct jitbuf b = { .code = mem, .len = 0 };
+	emit_program(&b, prog);
+
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) < 0) {
+		munmap(mem, size);
+		return -1;
+	}
+
+	prog->native = (expr_native_f)mem;
+	prog->native_size = size;
+
+	return 0;
+}
+
+void expr_jit_release(struct expr_prog *prog)
+{
+	if (prog->native != NULL)
+		munmap((void *)prog->native, prog->native_size);
+
+	prog->native = NULL;
+	prog->native_size = 0;
+}
+
+#else
+
+int expr_jit(struct expr_prog *prog)
+{
+	(void)prog;
+	return -1;
+}
+
+void expr_jit_release(struct expr_prog *prog)
+{
+	prog->native = NULL;
+	prog->native_size = 0;
+}
+
+#endif
@@ -5,6 +5,8 @@
 #include "engine/physics.h"
 #include "engine/render.h"
 #include "gameui.h"
+#include "gameconfig.h"
+#include "replay.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -12,6 +14,11 @@
 
 _Bool star_collected = 0;
 
+// physics steps since the level was loaded
+static unsigned long ticks;
+// the number the level was loaded by, -1 if it was not
+static int level_num = -1;
+
 //struct leveldata data;
 extern struct game game;
 
@@ -40,6 +47,10 @@ static void load_level(struct leveldata ldata)
 	game.level = ldata;
 
 	star_collected = 0;
+	ticks = 0;
+
+	// a run that is being recorded or played back does not go on past here
+	replay_stop();
 
 	reset_player();
 	physics_pause();
@@ -67,6 +78,31 @@ _Bool level_star_collected(void)
 	return star_collected;
 }
 
+float level_time(void)
+{
+	return (float)ticks / PHYSICS_RATE;
+}
+
+void level_tick(void)
+{
+	ticks++;
+}
+
+unsigned long level_ticks(void)
+{
+	return ticks;
+}
+
+void level_seek(unsigned long to)
+{
+	ticks = to;
+}
+
+int level_number(void)
+{
+	return level_num;
+}
+
 void level_finish(void)
 {
 	physics_pause();
@@ -228,7 +264,7 @@ static void read_pair(struct lpar *lpar)
 
 	switch (name) {
 	case LFIDX_FUNC: {
-		char func[64];
+		char func[sizeof lpar->ldata.func];
 		read_func(lpar, func);
 		strcpy(lpar->ldata.func, func);
 		break;
@@ -288,5 +324,9 @@ int load_level_num(int n)
 	char filename[16];
 	snprintf(filename, 16, "res/lvl/%d.lvl", n);
 
-	return load_level_file(filename);
+	if (load_level_file(filename) < 0)
+		return -1;
+
+	level_num = n;
+	return 0;
 }
@@ -23,10 +23,13 @@ struct {
 
 static void player_update(const float fdt)
 {
+	struct player *player = game.player;
+
+	player->prev_pos = player->pos;
+	player->prev_rotation = player->rotation;
+
 	if (physics.paused)
 		return;
-	
-	struct player *player = game.player;
 
 	//	printf("x force: %f\n", player->body.force.x);
 
@@ -46,8 +49,12 @@ static void player_update(const float fdt)
 	player->body.linear_velocity.y += linear_acceleration.y * fdt;
 
 
-	player->pos.x += player->body.linear_velocity.x * fdt;
-	player->pos.y += player->body.linear_velocity.y * fdt;
+	//   The player stops where it first touches the graph, however far it
+	// would have gone, so the contacts below find it there instead of on
+	// the far side.
+	const Vector2 step = Vector2Scale(player->body.linear_velocity, fdt);
+	player->pos = Vector2Add(player->pos,
+				 Vector2Scale(step, player_sweep_graph(step)));
 
 	float angular_acceleration =
 		player->body.torque / player->body.moment_of_inertia;
@@ -59,16 +66,19 @@ static void player_update(const float fdt)
 
 	player->body.friction = (Vector2){ 0, 0 };
 	
-	Vector2 coll;
-	int collides = 0;
-	for (int c = 0; c < (int)arraylist_count(&game.level.obstacles)+1;c++) {
-	if (player_collides(&coll, c)) {
+	struct contact contacts[PLAYER_CONTACTS_MAX];
+	const size_t collides = player_contacts(contacts, PLAYER_CONTACTS_MAX);
+	const Vector2 start = player->pos;
+	for (size_t c = 0; c < collides; c++) {
+		//   The contacts were all found before any was resolved, what the
+		// ones before have pushed the player out along this one's normal
+		// is already done.
+		struct contact contact = contacts[c];
+		const Vector2 moved = Vector2Subtract(player->pos, start);
+		contact.depth -= Vector2DotProduct(moved, contact.normal);
+
 		player->body.on_ground++;
-		resolve_collision(coll);
-		collides += 1;
-	} else {
-		
-	}
+		resolve_collision(&contact);
 	}
 	if(collides >1) {
 		player->body.linear_velocity = Vector2Scale(player->body.linear_velocity, 0.5f);
@@ -79,11 +89,14 @@ static void player_update(const float fdt)
 	player->old_pos = player->pos;
 }
 
-void resolve_collision(Vector2 coll)
+void resolve_collision(const struct contact *contact)
 {
 	struct player *player = game.player;
+	const Vector2 coll = contact->point;
+	const Vector2 normal = contact->normal;
 
 	player->body.collision = coll;
+	player->body.coll_nor = normal;
 		
 	printf("co: %i\n",player->body.on_ground);
 		const Vector2 hit_distance = { player->pos.x - coll.x,
@@ -96,13 +109,16 @@ void resolve_collision(Vector2 coll)
 		const Vector2 vel_normal =
 			Vector2Normalize(player->body.linear_velocity);
 
-		Vector2 diff = Vector2Subtract(
-			Vector2Scale(Vector2Normalize(hit_distance),
-				     player->radius),
-			hit_distance);
+		// Vector2 diff = Vector2Subtract(
+		// 	Vector2Scale(Vector2Normalize(hit_distance),
+		// 		     player->radius),
+		// 	hit_distance);
 
 		Vector2 c;
-		player->pos = Vector2Add(player->pos,  diff  ); // based on hit_distance
+		//player->pos = Vector2Add(player->pos,  diff  ); // based on hit_distance
+		if (contact->depth > 0) // based on depth
+			player->pos = Vector2Add(player->pos,
+						 Vector2Scale(normal, contact->depth));
 		//player->pos = Vector2Add(player->pos,  Vector2Scale(Vector2Negate(vel_normal), Vector2Length(diff))  ); // based on vel_normal
 		// for (int i = 0; i < 20; i++) { // based on coll_nor
 		// 	player->pos = Vector2Add(player->pos, player->body.coll_nor);
@@ -123,9 +139,6 @@ void resolve_collision(Vector2 coll)
 
 
 
-		player->body.coll_nor = Vector2Normalize((Vector2){
-			player->pos.x - coll.x, player->pos.y - coll.y });
-
 		Vector2 move = player->body.linear_velocity;
 		Vector2 slide = (Vector2){ 0, 0 };
 		//move = Vector2Reflect(player->body.linear_velocity,
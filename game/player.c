@@ -15,6 +15,11 @@ extern struct game game;
 
 static struct player player = { 0 };
 
+// how far the graph reaches out to either side of its samples
+#define GRAPH_WIDTH 7
+// how close to a surface the player counts as touching it when a sweep starts
+#define SWEEP_SLOP 0.01F
+
 static _Bool player_contained(Vector2 p, float *distance, float radius)
 {
 	//printf("p { %f, %f }\n", p.x, p.y);
@@ -26,55 +31,246 @@ static _Bool player_contained(Vector2 p, float *distance, float radius)
 	return Vector2Length(v) <= player.radius+radius;
 }
 
-static _Bool player_collides_with_graph(Vector2 *point)
+//   Tests the player against a segment thickened by <width> on both sides.
+// The contact point is the closest point on the thickened segment's surface,
+// <closest> if not NULL gets the closest point on the segment itself.
+static _Bool player_collides_with_segment(Vector2 a, Vector2 b, float width,
+					  Vector2 *point, Vector2 *closest)
 {
-	// TODO fix this mess later
+	Vector2 line_vec = Vector2Subtract(b, a);
+	Vector2 ballToLineStart = Vector2Subtract(player.pos, a);
+	float lineLength = Vector2Length(line_vec);
+	Vector2 lineDir = Vector2Normalize(line_vec);
+	float projection = Vector2DotProduct(ballToLineStart, lineDir);
+	projection = fmaxf(0, fminf(projection, lineLength));
+	Vector2 closestPoint = Vector2Add(a, Vector2Scale(lineDir, projection));
+	Vector2 distToBall = Vector2Subtract(player.pos, closestPoint);
+	float dist = Vector2Length(distToBall);
+	if (closest != NULL)
+		*closest = closestPoint;
 
-	const int precision = 10;
-	const int width = 7;
+	if (dist <= width + player.radius) {
+		*point = Vector2Add(closestPoint, Vector2Scale(Vector2Normalize(distToBall), width));
+		return 1;
+	}
+	return 0;
+}
 
-	float old_dist = INFINITY;
-	float dist;
+//   The normal at a graph contact comes from the formula's exact slope at the
+// closest point, turned to face the player.
+static Vector2 graph_contact_normal(unsigned graph, Vector2 closest)
+{
+	const Vector2 normal = graph_normal(graph, closest.x);
+	const Vector2 away = Vector2Subtract(player.pos, closest);
+	return Vector2DotProduct(normal, away) < 0 ? Vector2Negate(normal) :
+						     normal;
+}
 
-	size_t points = arraylist_count(&game.graph_points);
-	//printf("points %i\n", points);
-	for (size_t i = 0; i < points; ++i) {
-		//	const float x = (float)i - (float)points / 2;
-		//	const float *y = arraylist_get(&game.graph_points, i);
-		//	const Vector2 p = { (float)x / (float)precision,
-		//			    *y * GRAPH_SCALE };
+//   Every formula is tested in one sweep over the shared store. Runs whose
+// samples do not come near the player's height are passed over whole, and
+// the bounding trees of the others lead to the few leaves of segments around
+// the player, which are then tested one by one. Only the nearest segment
+// makes a contact.
+static _Bool player_collides_with_graph(struct contact *contact)
+{
+	const float width = GRAPH_WIDTH;
+
+	const float reach = player.radius + width;
+
+	const struct graph_samples *s = graph_store();
+	size_t count;
+	const struct graph_run *runs =
+		graph_runs(graph_chunk_index(player.pos.x - reach),
+			   graph_chunk_index(player.pos.x + reach), &count);
+
+	float old_dist = INFINITY;
+	Vector2 nearest = player.pos;
+	unsigned graph = 0;
 
-		const Vector2 *p = arraylist_get(&game.graph_points, i);
+	const struct graph_box box = {
+		player.pos.x - reach, player.pos.x + reach,
+		player.pos.y - reach, player.pos.y + reach,
+	};
 
-		if (p == NULL)
+	for (size_t r = 0; r < count; ++r) {
+		const struct graph_run *run = &runs[r];
+		if (box.bottom < run->top || box.top > run->bottom)
 			continue;
 
-		Vector2 e = *p;
-		e.y *= -1;
-		Vector2 distance = Vector2Subtract(player.pos, e);
-
-		if (player_contained(e, &dist, width)) {
-			//dist = Vector2Length(Vector2Subtract(player.pos, Vector2Add(e, Vector2Scale(Vector2Normalize(distance), width))));
-			if (dist < old_dist) {
-				old_dist = dist;
-				*point = Vector2Add(e, Vector2Scale(Vector2Normalize(distance), width));
-				player.body.debug = *point;
-				//point->x = e.x;
-				//point->y = e.y;
+		struct graph_query q;
+		size_t first, last;
+		graph_query_begin(&q, run, box);
+
+		while (graph_query_next(&q, &first, &last)) {
+			for (size_t i = first + 1; i <= last; ++i) {
+				if (graph_break(s->x[i - 1]) ||
+				    graph_break(s->x[i]))
+					continue;
+
+				if (fmaxf(s->x[i - 1], s->x[i]) < box.left ||
+				    fminf(s->x[i - 1], s->x[i]) > box.right)
+					continue;
+
+				const Vector2 a = { s->x[i - 1], s->y[i - 1] };
+				const Vector2 b = { s->x[i], s->y[i] };
+
+				Vector2 point, closest;
+				if (!player_collides_with_segment(
+					    a, b, width, &point, &closest))
+					continue;
+
+				const float dist =
+					Vector2Distance(player.pos, closest);
+				if (dist < old_dist) {
+					old_dist = dist;
+					nearest = closest;
+					graph = run->graph;
+					contact->point = point;
+					player.body.debug = point;
+				}
 			}
+		}
+	}
+	if (old_dist == INFINITY)
+		return 0;
 
-			//return 1;
+	contact->normal = graph_contact_normal(graph, nearest);
+	contact->depth = reach - old_dist;
+	contact->source = 0;
+	return 1;
+}
+
+//   The earliest fraction of <step> at which a point moving from <p> comes
+// within <reach> of the segment from <a> to <b>, or 1 if it does not. The
+// thickened segment is a capsule, its two sides and its two round ends are
+// solved for separately.
+static float sweep_segment(Vector2 p, Vector2 step, Vector2 a, Vector2 b,
+			   float reach)
+{
+	float toi = 1;
+
+	const Vector2 ab = Vector2Subtract(b, a);
+	const float len2 = Vector2DotProduct(ab, ab);
+
+	if (len2 > 0) {
+		const Vector2 n = Vector2Normalize((Vector2){ -ab.y, ab.x });
+		const float side = Vector2DotProduct(Vector2Subtract(p, a), n);
+		const float towards = Vector2DotProduct(step, n);
+
+		if (side * towards < 0) {
+			const float surface = side > 0 ? reach : -reach;
+			const float t = (surface - side) / towards;
+			const Vector2 at = Vector2Add(p, Vector2Scale(step, t));
+			const float u =
+				Vector2DotProduct(Vector2Subtract(at, a), ab) /
+				len2;
+
+			if (t >= 0 && t < toi && u >= 0 && u <= 1)
+				toi = t;
 		}
 	}
-	if (old_dist != INFINITY) {
-		return 1;
+
+	const float d2 = Vector2DotProduct(step, step);
+	if (d2 == 0)
+		return toi;
+
+	const Vector2 ends[] = { a, b };
+	for (size_t k = 0; k < 2; ++k) {
+		const Vector2 m = Vector2Subtract(p, ends[k]);
+		const float half_b = Vector2DotProduct(m, step);
+		const float c = Vector2DotProduct(m, m) - reach * reach;
+		const float disc = half_b * half_b - d2 * c;
+
+		if (half_b >= 0 || disc < 0)
+			continue;
+
+		const float t = (-half_b - sqrtf(disc)) / d2;
+		if (t >= 0 && t < toi)
+			toi = t;
 	}
-	return 0;
+
+	return toi;
+}
+
+float player_sweep_graph(Vector2 step)
+{
+	const float reach = player.radius + GRAPH_WIDTH;
+	const Vector2 to = Vector2Add(player.pos, step);
+
+	const struct graph_box box = {
+		fminf(player.pos.x, to.x) - reach,
+		fmaxf(player.pos.x, to.x) + reach,
+		fminf(player.pos.y, to.y) - reach,
+		fmaxf(player.pos.y, to.y) + reach,
+	};
+
+	const struct graph_samples *s = graph_store();
+	size_t count;
+	const struct graph_run *runs =
+		graph_runs(graph_chunk_index(box.left),
+			   graph_chunk_index(box.right), &count);
+
+	float toi = 1;
+
+	for (size_t r = 0; r < count; ++r) {
+		const struct graph_run *run = &runs[r];
+		if (box.bottom < run->top || box.top > run->bottom)
+			continue;
+
+		struct graph_query q;
+		size_t first, last;
+		graph_query_begin(&q, run, box);
+
+		while (graph_query_next(&q, &first, &last)) {
+			for (size_t i = first + 1; i <= last; ++i) {
+				if (graph_break(s->x[i - 1]) ||
+				    graph_break(s->x[i]))
+					continue;
+
+				const Vector2 a = { s->x[i - 1], s->y[i - 1] };
+				const Vector2 b = { s->x[i], s->y[i] };
+
+				Vector2 touch, closest;
+				if (!player_collides_with_segment(
+					    a, b, GRAPH_WIDTH + SWEEP_SLOP,
+					    &touch, &closest)) {
+					toi = fminf(toi,
+						    sweep_segment(player.pos,
+								  step, a, b,
+								  reach));
+					continue;
+				}
+
+				//   A surface the player already touches lets
+				// it move away freely, and into it only until
+				// the center has come halfway to the segment.
+				// The contacts push it back out, and however
+				// fast it goes it cannot cross to the far side.
+				const Vector2 away =
+					Vector2Subtract(player.pos, closest);
+				if (Vector2DotProduct(step, away) >= 0)
+					continue;
+
+				const float dist = Vector2Length(away);
+				toi = fminf(toi, sweep_segment(player.pos, step,
+							       a, b, dist / 2));
+			}
+		}
+	}
+
+	return toi;
 }
 
-static _Bool player_collides_with_obstacle(struct obstacle ob, Vector2 *point)
+static _Bool player_collides_with_obstacle(struct obstacle ob,
+					   struct contact *contact)
 {
 	const float height = ob.size.y/2;
+
+	// nothing on the obstacle is further from its center than this
+	const float extent = Vector2Length(ob.size) / 2;
+	if (Vector2Distance(player.pos, ob.pos) > extent + player.radius)
+		return 0;
+
 	Vector2 points[2];
 	// if (Vector2Distance(player.pos, ob.pos) < player.radius *2) {
 	// 	*point = Vector2Subtract(ob.pos, Vector2Scale(Vector2Subtract(ob.pos, player.pos), 0.5F));
@@ -85,43 +281,39 @@ static _Bool player_collides_with_obstacle(struct obstacle ob, Vector2 *point)
 	points[1] = Vector2Add(ob.pos, Vector2Rotate((Vector2){ob.size.x/2-height,0}, ob.rotation*PI/180.0F) );
 
 	// 0-1
-	Vector2 line_vec = Vector2Subtract(points[1], points[0]);
-	Vector2 ballToLineStart = Vector2Subtract(player.pos, points[0]);
-	float lineLength = Vector2Length(line_vec);
-	Vector2 lineDir = Vector2Normalize(line_vec);
-	float projection = Vector2DotProduct(ballToLineStart, lineDir);
-	projection = fmaxf(0, fminf(projection, lineLength));
-	Vector2 closestPoint = Vector2Add(points[0], Vector2Scale(lineDir, projection));
-	Vector2 distToBall = Vector2Subtract(player.pos, closestPoint);
-	float dist = Vector2Length(distToBall);
-	if (dist <= height + player.radius) {
-		*point = Vector2Add(closestPoint, Vector2Scale(Vector2Normalize(distToBall), height));
-		return 1;
-	}
-	return 0;
+	Vector2 closest;
+	if (!player_collides_with_segment(points[0], points[1], height,
+					  &contact->point, &closest))
+		return 0;
+
+	// away from the obstacle's axis, which still holds once the center is
+	// inside the obstacle and the contact point is past it
+	contact->normal =
+		Vector2Normalize(Vector2Subtract(player.pos, closest));
+	contact->depth =
+		height + player.radius - Vector2Distance(player.pos, closest);
+	return 1;
 }
 
-_Bool player_collides(Vector2 *point, int id)
+size_t player_contacts(struct contact *contacts, size_t max)
 {
-	//int frames = (int)arraylist_count(&game.level.obstacles)+1;
+	size_t n = 0;
 
-	if (player_collides_with_graph(point) && id == 0) {
+	if (n < max && player_collides_with_graph(&contacts[n]))
+		n++;
 
-		return 1;
-	}
-	
-	/*
-	// check direct collisions against all graphs
-	for (int i = 0; i < game.ngraphs; ++i) {
-		if (player_collides_with_graph(game.graphs[i], point)) return 1;
-	}*/
 	for (size_t i = 0; i < arraylist_count(&game.level.obstacles); ++i) {
+		if (n == max)
+			break;
+
 		struct obstacle *ob = arraylist_get(&game.level.obstacles, i);
-		if (player_collides_with_obstacle(*ob, point) && id-1==(int)i) {
-			return 1;
+		if (player_collides_with_obstacle(*ob, &contacts[n])) {
+			contacts[n].source = 1 + (int)i;
+			n++;
 		}
 	}
-	return 0;
+
+	return n;
 }
 
 _Bool player_collides_with(Vector2 p)
@@ -144,7 +336,7 @@ void player_init(void)
 
 void reset_player(void)
 {
-	player.rotation = 0;
+	player.rotation = player.prev_rotation = 0;
 	player.body.linear_velocity = Vector2Zero();
 	player.body.angular_velocity = 0;
 	player.body.linear_accel = Vector2Zero();
@@ -158,5 +350,5 @@ void player_set_skin(const char *filename)
 
 void player_move(Vector2 to)
 {
-	player.pos = to;
+	player.pos = player.prev_pos = to;
 }
@@ -22,14 +22,24 @@ static struct {
 Texture2D star_tex;
 Texture2D dest_tex;
 
+//   Everything that stays put is drawn once into <layer> and only drawn again
+// when something it was drawn from changes, each frame is then one blit of it
+// and the player on top.
+static struct {
+	RenderTexture2D layer;
+
+	// what the layer was drawn from
+	Camera2D camera;
+	unsigned long graph_gen;
+	_Bool star;
+	_Bool valid;
+} cache;
+
 void render_init(void)
 {
 	rctx.graph_color = RED;
 	rctx.leveldata = malloc(sizeof *rctx.leveldata);
 
-	game.ngraphs = 1;
-	game.graphs = malloc(game.ngraphs * sizeof(graph_t));
-
 	texture_load(&star_tex, "res/img/star.png");
 	texture_load(&dest_tex, "res/img/destination.png");
 }
@@ -92,8 +102,34 @@ static void render_background(void)
 		0, WHITE);
 }
 
-void render(void)
+static _Bool same_camera(Camera2D a, Camera2D b)
+{
+	return a.target.x == b.target.x && a.target.y == b.target.y &&
+	       a.offset.x == b.offset.x && a.offset.y == b.offset.y &&
+	       a.rotation == b.rotation && a.zoom == b.zoom;
+}
+
+static _Bool cache_valid(void)
 {
+	const int w = (int)game.window->screen_w;
+	const int h = (int)game.window->screen_h;
+
+	if (cache.layer.texture.width != w || cache.layer.texture.height != h) {
+		if (cache.layer.id != 0)
+			UnloadRenderTexture(cache.layer);
+		cache.layer = LoadRenderTexture(w, h);
+		return 0;
+	}
+
+	return cache.valid && same_camera(cache.camera, game.camera) &&
+	       cache.graph_gen == graph_generation() &&
+	       cache.star == level_star_collected();
+}
+
+static void render_static(void)
+{
+	BeginMode2D(game.camera);
+
 	render_background();
 	render_graph();
 
@@ -103,20 +139,67 @@ void render(void)
 	if (!level_star_collected())
 		render_star();
 
+	EndMode2D();
+}
+
+static void update_cache(void)
+{
+	if (cache_valid())
+		return;
+
+	//   The layer is blended over the frame once more when it is blitted, so
+	// it has to stay opaque. Color blends as usual, but alpha only ever adds
+	// up, which keeps translucent and antialiased edges from letting the
+	// black underneath through a second time.
+	BeginTextureMode(cache.layer);
+	ClearBackground(BLACK);
+	rlSetBlendFactorsSeparate(RL_SRC_ALPHA, RL_ONE_MINUS_SRC_ALPHA, RL_ONE,
+				  RL_ONE_MINUS_SRC_ALPHA, RL_FUNC_ADD,
+				  RL_FUNC_ADD);
+	BeginBlendMode(BLEND_CUSTOM_SEPARATE);
+	render_static();
+	EndBlendMode();
+	EndTextureMode();
+
+	cache.camera = game.camera;
+	cache.graph_gen = graph_generation();
+	cache.star = level_star_collected();
+	cache.valid = 1;
+}
+
+void render(void)
+{
+	update_cache();
+
+	// render textures are stored bottom up, hence the negative height
+	const Texture2D *layer = &cache.layer.texture;
+	DrawTextureRec(*layer,
+		       (Rectangle){ 0, 0, (float)layer->width,
+				    -(float)layer->height },
+		       (Vector2){ 0, 0 }, WHITE);
+
+	BeginMode2D(game.camera);
+
 	const struct player *player = game.player;
 	const Vector2 size = { player->tex_size * 2, player->tex_size * 2 };
+	const Vector2 pos =
+		Vector2Lerp(player->prev_pos, player->pos, game.alpha);
+	const float rotation =
+		Lerp(player->prev_rotation, player->rotation, game.alpha);
 	// DrawCircleV(player->pos, player->radius, BLUE);
-	texture_draw(&player->tex, player->pos, size, player->rotation,
-		     player->tint);
+	texture_draw(&player->tex, pos, size, rotation, player->tint);
 
 	// DrawCircleV(player->body.collision, 2, GREEN);
 	// DrawLineV(player->pos,
 	// 	  (Vector2){ player->pos.x + player->body.debug.x,
 	// 		     player->pos.y + player->body.debug.y },
 	// 	  RED);
+
+	EndMode2D();
 }
 
 void render_feed_leveldata(const struct leveldata *data)
 {
 	memcpy(rctx.leveldata, data, sizeof *data);
+	cache.valid = 0;
 }
@@ -0,0 +1,380 @@
+#include "replay.h"
+#include "game.h"
+#include "graph.h"
+#include "level.h"
+#include "player.h"
+#include "engine/physics.h"
+#include <raylib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//   A log is a header followed by one record per physics step, every field
+// written on its own so that no padding ends up in the file:
+//
+//   "MLRP", version       u32
+//   level                 i32, -1 if the level was not loaded by number
+//   formula               sizeof leveldata.func bytes, zero padded
+//   ticks                 u32, level ticks when the run started
+//   state                 the player the run started in, every field of
+//                         replay_state in turn, f32 apart from on_ground,
+//                         which is an i32
+//   steps                 u32
+//   steps times:
+//     nudge               two f32
+//     flags               u8, REPLAY_PAUSED
+//     hash                u32, the rolling hash after the step
+//
+//   The hash covers the player's physics state only, its texture and tint
+// play no part in a run. It is taken over the same fields, so padding in
+// replay_state never reaches it either.
+
+#define REPLAY_MAGIC "MLRP"
+#define REPLAY_VERSION 2
+#define REPLAY_PAUSED 1
+
+extern struct game game;
+
+// the part of the player a run is made of
+struct replay_state {
+	Vector2 pos, old_pos, prev_pos;
+	float rotation, prev_rotation;
+	struct player_body body;
+};
+
+#define STATE_FIELD(f) \
+	{ offsetof(struct replay_state, f), sizeof((struct replay_state *)0)->f }
+
+static const struct {
+	size_t offset, size;
+} state_fields[] = {
+	STATE_FIELD(pos.x),
+	STATE_FIELD(pos.y),
+	STATE_FIELD(old_pos.x),
+	STATE_FIELD(old_pos.y),
+	STATE_FIELD(prev_pos.x),
+	STATE_FIELD(prev_pos.y),
+	STATE_FIELD(rotation),
+	STATE_FIELD(prev_rotation),
+	STATE_FIELD(body.mass),
+	STATE_FIELD(body.linear_velocity.x),
+	STATE_FIELD(body.linear_velocity.y),
+	STATE_FIELD(body.linear_accel.x),
+	STATE_FIELD(body.linear_accel.y),
+	STATE_FIELD(body.force.x),
+	STATE_FIELD(body.force.y),
+	STATE_FIELD(body.friction.x),
+	STATE_FIELD(body.friction.y),
+	STATE_FIELD(body.angular_velocity),
+	STATE_FIELD(body.torque),
+	STATE_FIELD(body.moment_of_inertia),
+	STATE_FIELD(body.collision.x),
+	STATE_FIELD(body.collision.y),
+	STATE_FIELD(body.coll_nor.x),
+	STATE_FIELD(body.coll_nor.y),
+	STATE_FIELD(body.debug.x),
+	STATE_FIELD(body.debug.y),
+	STATE_FIELD(body.on_ground),
+};
+
+#define STATE_FIELDS (sizeof state_fields / sizeof *state_fields)
+
+_Static_assert(sizeof(int) == 4, "on_ground is logged as an i32");
+
+struct replay_step {
+	struct replay_input input;
+	uint32_t hash;
+};
+
+enum replay_mode {
+	REPLAY_OFF,
+	REPLAY_RECORDING,
+	REPLAY_WAITING, // for the formula of a playback to be built
+	REPLAY_PLAYING,
+};
+
+static struct {
+	enum replay_mode mode;
+
+	int32_t level;
+	char formula[sizeof game.level.func];
+	uint32_t ticks;
+	struct replay_state start;
+
+	struct replay_step *steps;
+	size_t count, cap;
+	size_t at; // the step being played back
+
+	uint32_t hash;
+	_Bool diverged;
+} replay;
+
+static void save_state(struct replay_state *s, const struct player *p)
+{
+	memset(s, 0, sizeof *s);
+	s->pos = p->pos;
+	s->old_pos = p->old_pos;
+	s->prev_pos = p->prev_pos;
+	s->rotation = p->rotation;
+	s->prev_rotation = p->prev_rotation;
+	s->body = p->body;
+}
+
+static void restore_state(struct player *p, const struct replay_state *s)
+{
+	p->pos = s->pos;
+	p->old_pos = s->old_pos;
+	p->prev_pos = s->prev_pos;
+	p->rotation = s->rotation;
+	p->prev_rotation = s->prev_rotation;
+	p->body = s->body;
+}
+
+// FNV-1a, carried on from <hash>
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t n)
+{
+	const unsigned char *b = data;
+	for (size_t i = 0; i < n; ++i)
+		hash = (hash ^ b[i]) * 16777619U;
+
+	return hash;
+}
+
+static uint32_t hash_state(uint32_t hash, const struct replay_state *s)
+{
+	for (size_t i = 0; i < STATE_FIELDS; ++i)
+		hash = hash_bytes(hash, (const char *)s + state_fields[i].offset,
+				  state_fields[i].size);
+
+	return hash;
+}
+
+static void push_step(const struct replay_step *step)
+{
+	if (replay.count == replay.cap) {
+		replay.cap = replay.cap ? 2 * replay.cap : 4096;
+
+		const size_t size = replay.cap * sizeof *replay.steps;
+		replay.steps = realloc(replay.steps, size);
+	}
+
+	replay.steps[replay.count++] = *step;
+}
+
+static void put(FILE *f, const void *data, size_t n, _Bool *ok)
+{
+	*ok &= fwrite(data, n, 1, f) == 1;
+}
+
+static void get(FILE *f, void *data, size_t n, _Bool *ok)
+{
+	*ok &= fread(data, n, 1, f) == 1;
+}
+
+static void put_state(FILE *f, const struct replay_state *s, _Bool *ok)
+{
+	for (size_t i = 0; i < STATE_FIELDS; ++i)
+		put(f, (const char *)s + state_fields[i].offset,
+		    state_fields[i].size, ok);
+}
+
+static void get_state(FILE *f, struct replay_state *s, _Bool *ok)
+{
+	memset(s, 0, sizeof *s);
+	for (size_t i = 0; i < STATE_FIELDS; ++i)
+		get(f, (char *)s + state_fields[i].offset,
+		    state_fields[i].size, ok);
+}
+
+static int write_log(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+		return -1;
+
+	const uint32_t version = REPLAY_VERSION;
+	const uint32_t count = (uint32_t)replay.count;
+	_Bool ok = 1;
+
+	put(f, REPLAY_MAGIC, 4, &ok);
+	put(f, &version, sizeof version, &ok);
+	put(f, &replay.level, sizeof replay.level, &ok);
+	put(f, replay.formula, sizeof replay.formula, &ok);
+	put(f, &replay.ticks, sizeof replay.ticks, &ok);
+	put_state(f, &replay.start, &ok);
+	put(f, &count, sizeof count, &ok);
+
+	for (size_t i = 0; i < replay.count; ++i) {
+		const struct replay_step *s = &replay.steps[i];
+		const uint8_t flags = s->input.paused ? REPLAY_PAUSED : 0;
+
+		put(f, &s->input.nudge.x, sizeof s->input.nudge.x, &ok);
+		put(f, &s->input.nudge.y, sizeof s->input.nudge.y, &ok);
+		put(f, &flags, sizeof flags, &ok);
+		put(f, &s->hash, sizeof s->hash, &ok);
+	}
+
+	ok &= fclose(f) == 0;
+	return ok ? 0 : -1;
+}
+
+static int read_log(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return -1;
+
+	char magic[4];
+	uint32_t version, count;
+	_Bool ok = 1;
+
+	get(f, magic, sizeof magic, &ok);
+	get(f, &version, sizeof version, &ok);
+	ok &= memcmp(magic, REPLAY_MAGIC, 4) == 0 && version == REPLAY_VERSION;
+
+	get(f, &replay.level, sizeof replay.level, &ok);
+	get(f, replay.formula, sizeof replay.formula, &ok);
+	get(f, &replay.ticks, sizeof replay.ticks, &ok);
+	get_state(f, &replay.start, &ok);
+	get(f, &count, sizeof count, &ok);
+	replay.formula[sizeof replay.formula - 1] = 0;
+
+	replay.count = 0;
+	for (uint32_t i = 0; ok && i < count; ++i) {
+		struct replay_step s = { 0 };
+		uint8_t flags;
+
+		get(f, &s.input.nudge.x, sizeof s.input.nudge.x, &ok);
+		get(f, &s.input.nudge.y, sizeof s.input.nudge.y, &ok);
+		get(f, &flags, sizeof flags, &ok);
+		get(f, &s.hash, sizeof s.hash, &ok);
+		s.input.paused = (flags & REPLAY_PAUSED) != 0;
+
+		push_step(&s);
+	}
+
+	fclose(f);
+	return ok ? 0 : -1;
+}
+
+void replay_record(int level, const char *formula)
+{
+	replay_stop();
+
+	replay.mode = REPLAY_RECORDING;
+	replay.level = level;
+	strncpy(replay.formula, formula, sizeof replay.formula - 1);
+	replay.formula[sizeof replay.formula - 1] = 0;
+	replay.ticks = (uint32_t)level_ticks();
+	save_state(&replay.start, game.player);
+
+	replay.count = 0;
+	replay.hash = hash_state(2166136261U, &replay.start);
+
+	printf("replay: recording level %d, \"%s\".\n", level, formula);
+}
+
+int replay_play(const char *path)
+{
+	replay_stop();
+
+	if (read_log(path) < 0) {
+		printf("cannot read replay \"%s\".\n", path);
+		replay.count = 0;
+		return -1;
+	}
+
+	if (replay.level >= 0)
+		load_level_num(replay.level);
+	else
+		reload_level();
+
+	build_fgraph(replay.formula);
+
+	replay.mode = replay.count > 0 ? REPLAY_WAITING : REPLAY_OFF;
+	replay.at = 0;
+	replay.diverged = 0;
+
+	printf("replay: playing %zu steps of level %d, \"%s\".\n",
+	       replay.count, replay.level, replay.formula);
+	return 0;
+}
+
+void replay_stop(void)
+{
+	if (replay.mode == REPLAY_RECORDING) {
+		if (write_log(REPLAY_FILE) < 0)
+			printf("cannot write replay \"%s\".\n", REPLAY_FILE);
+		else
+			printf("replay: %zu steps written to \"%s\".\n",
+			       replay.count, REPLAY_FILE);
+	}
+
+	replay.mode = REPLAY_OFF;
+}
+
+_Bool replay_recording(void)
+{
+	return replay.mode == REPLAY_RECORDING;
+}
+
+_Bool replay_playing(void)
+{
+	return replay.mode == REPLAY_WAITING || replay.mode == REPLAY_PLAYING;
+}
+
+_Bool replay_input(struct replay_input *input)
+{
+	switch (replay.mode) {
+	case REPLAY_OFF:
+		return 1;
+	case REPLAY_RECORDING:
+		push_step(&(struct replay_step){ .input = *input });
+		return 1;
+	case REPLAY_WAITING:
+		if (graph_pending())
+			return 0;
+
+		//   The level is loaded and the formula built, the run picks
+		// up from where it was recorded.
+		restore_state(game.player, &replay.start);
+		level_seek(replay.ticks);
+		replay.hash = hash_state(2166136261U, &replay.start);
+		replay.mode = REPLAY_PLAYING;
+		break;
+	case REPLAY_PLAYING:
+		break;
+	}
+
+	*input = replay.steps[replay.at].input;
+	return 1;
+}
+
+void replay_check(const struct player *player)
+{
+	if (replay.mode != REPLAY_RECORDING && replay.mode != REPLAY_PLAYING)
+		return;
+
+	struct replay_state s;
+	save_state(&s, player);
+	replay.hash = hash_state(replay.hash, &s);
+
+	if (replay.mode == REPLAY_RECORDING) {
+		replay.steps[replay.count - 1].hash = replay.hash;
+		return;
+	}
+
+	if (replay.hash != replay.steps[replay.at].hash && !replay.diverged) {
+		printf("replay: diverged at step %zu.\n", replay.at);
+		replay.diverged = 1;
+	}
+
+	replay.at++;
+	if (replay.at == replay.count) {
+		printf("replay: done, %s.\n",
+		       replay.diverged ? "it diverged" : "every step matched");
+		replay.mode = REPLAY_OFF;
+	}
+}
@@ -0,0 +1,120 @@
+#include "ribbon.h"
+#include "graph.h"
+#include <raylib.h>
+#include <raymath.h>
+#include <string.h>
+
+//   Every segment between two samples is a quad of its own, pushed out to
+// either side along the samples' normals, and v runs along its length from
+// the chunk's left edge. Segments that touch a break collapse to nothing, so
+// the indices only depend on the number of samples and a moving graph can
+// update its vertices in place while that stays the same.
+void ribbon_build(struct ribbon *r, const struct graph_samples *s,
+		  const size_t *keep, size_t n)
+{
+	const float width = RIBBON_WIDTH;
+
+	// indices are 16 bits wide
+	size_t segs = n > 1 ? n - 1 : 0;
+	if (segs > 65536 / 4)
+		segs = 65536 / 4;
+
+	const int nverts = (int)(4 * segs);
+	Mesh *mesh = &r->mesh;
+
+	if (mesh->vertexCount != nverts) {
+		ribbon_free(r);
+
+		mesh->vertexCount = nverts;
+		mesh->triangleCount = (int)(2 * segs);
+		mesh->vertices = MemAlloc(nverts * 3 * sizeof(float));
+		mesh->texcoords = MemAlloc(nverts * 2 * sizeof(float));
+		mesh->indices = MemAlloc(segs * 6 * sizeof(unsigned short));
+
+		for (size_t i = 0; i < segs; ++i) {
+			const unsigned short quad[] = { 0, 1, 2, 0, 2, 3 };
+			for (size_t k = 0; k < 6; ++k)
+				mesh->indices[6 * i + k] =
+					(unsigned short)(4 * i + quad[k]);
+		}
+	} else if (r->uploaded) {
+		r->stale = 1;
+	}
+
+	float *vert = mesh->vertices;
+	float *tex = mesh->texcoords;
+	float v = 0;
+
+	for (size_t i = 0; i < segs; ++i, vert += 12, tex += 8) {
+		const size_t p = keep != NULL ? keep[i] : i;
+		const size_t q = keep != NULL ? keep[i + 1] : i + 1;
+
+		if (graph_break(s->x[p]) || graph_break(s->x[q])) {
+			memset(vert, 0, 12 * sizeof *vert);
+			memset(tex, 0, 8 * sizeof *tex);
+			continue;
+		}
+
+		const Vector2 a = { s->x[p], s->y[p] };
+		const Vector2 b = { s->x[q], s->y[q] };
+		const Vector2 na =
+			Vector2Scale((Vector2){ s->nx[p], s->ny[p] }, width);
+		const Vector2 nb =
+			Vector2Scale((Vector2){ s->nx[q], s->ny[q] }, width);
+
+		const Vector2 corners[] = {
+			Vector2Subtract(a, na),
+			Vector2Add(a, na),
+			Vector2Add(b, nb),
+			Vector2Subtract(b, nb),
+		};
+
+		const float next_v = v + Vector2Distance(a, b);
+		const float uvs[] = { 0, v, 1, v, 1, next_v, 0, next_v };
+
+		for (size_t k = 0; k < 4; ++k) {
+			vert[3 * k] = corners[k].x;
+			vert[3 * k + 1] = corners[k].y;
+			vert[3 * k + 2] = 0;
+		}
+
+		memcpy(tex, uvs, sizeof uvs);
+		v = next_v;
+	}
+}
+
+void ribbon_free(struct ribbon *r)
+{
+	if (r->uploaded) {
+		UnloadMesh(r->mesh);
+	} else {
+		MemFree(r->mesh.vertices);
+		MemFree(r->mesh.texcoords);
+		MemFree(r->mesh.indices);
+	}
+
+	r->mesh = (Mesh){ 0 };
+	r->uploaded = r->stale = 0;
+}
+
+void ribbon_draw(struct ribbon *r, Material material, _Bool dynamic)
+{
+	Mesh *mesh = &r->mesh;
+	if (mesh->vertexCount == 0)
+		return;
+
+	if (!r->uploaded) {
+		UploadMesh(mesh, dynamic);
+		r->uploaded = 1;
+		r->stale = 0;
+	} else if (r->stale) {
+		const int n = mesh->vertexCount;
+		UpdateMeshBuffer(*mesh, 0, mesh->vertices,
+				 n * 3 * sizeof(float), 0);
+		UpdateMeshBuffer(*mesh, 1, mesh->texcoords,
+				 n * 2 * sizeof(float), 0);
+		r->stale = 0;
+	}
+
+	DrawMesh(*mesh, material, MatrixIdentity());
+}
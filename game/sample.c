@@ -0,0 +1,315 @@
+#include "graph.h"
+#include "expr.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//   Adaptive sampling of compiled formulas into graph chunks. It needs nothing
+// from raylib but its vector type, so the benchmark can link it on its own.
+
+//   The slope is taken exactly, and turned into a normal in the flipped space
+// the graph is drawn in. A slope that is not finite stands the curve upright.
+Vector2 graph_slope_normal(float dy)
+{
+	if (isinf(dy))
+		return (Vector2){ copysignf(1, dy), 0 };
+	if (isnan(dy))
+		return (Vector2){ 0, 1 };
+
+	const float len = hypotf(dy, 1);
+	return (Vector2){ dy / len, 1 / len };
+}
+
+//   The four arrays share one allocation, so growing moves each of them into
+// its place in the new block.
+void graph_samples_reserve(struct graph_samples *s, size_t cap)
+{
+	if (cap <= s->cap)
+		return;
+
+	float *block = malloc(4 * cap * sizeof *block);
+
+	float *arrays[] = { s->x, s->y, s->nx, s->ny };
+	for (size_t i = 0; i < 4; ++i) {
+		if (s->count != 0)
+			memcpy(block + i * cap, arrays[i], s->count * sizeof *block);
+	}
+
+	free(s->x);
+	s->x = block;
+	s->y = block + cap;
+	s->nx = block + 2 * cap;
+	s->ny = block + 3 * cap;
+	s->cap = cap;
+}
+
+void graph_samples_push(struct graph_samples *s, Vector2 pos, Vector2 normal)
+{
+	if (s->count == s->cap)
+		graph_samples_reserve(s, s->cap != 0 ? s->cap * 2 : 64);
+
+	s->x[s->count] = pos.x;
+	s->y[s->count] = pos.y;
+	s->nx[s->count] = normal.x;
+	s->ny[s->count] = normal.y;
+	s->count++;
+}
+
+void graph_samples_destroy(struct graph_samples *s)
+{
+	free(s->x);
+	memset(s, 0, sizeof *s);
+}
+
+static void push_point(const struct expr_prog *prog, struct graph_samples *out,
+		       float x, float y)
+{
+	float dy;
+	expr_eval_dual(prog, x, &dy);
+
+	graph_samples_push(out, (Vector2){ x * GRAPH_SCALE, -y * GRAPH_SCALE },
+			   graph_slope_normal(dy));
+}
+
+static void push_break(struct graph_samples *out)
+{
+	if (out->count == 0 || graph_break(out->x[out->count - 1]))
+		return;
+
+	graph_samples_push(out, (Vector2){ NAN, NAN }, (Vector2){ 0, 0 });
+}
+
+//   Adds the points after <a> up to and including <b>. The interval is halved
+// while its midpoint strays from the chord by more than GRAPH_TOLERANCE, or
+// while interval evaluation says the curve may break in it. Once it is as
+// fine as it gets, a possible break whose midpoint is not even between the
+// ends is taken to be a jump, and the polyline is broken there. Values that
+// are not finite are never connected to anything.
+//   Intervals inside one that cannot break cannot break either, so <maybe>
+// only has to be checked again below intervals that could.
+static void sample(const struct expr_prog *prog, struct graph_samples *points,
+		   float a, float fa, float b, float fb, int depth, _Bool maybe)
+{
+	const float m = (a + b) / 2;
+	const float fm = expr_eval(prog, m);
+
+	if (!isfinite(fa) || !isfinite(fb)) {
+		const _Bool gap = !isfinite(fa) && !isfinite(fb) && !isfinite(fm);
+		if (depth < GRAPH_DEPTH && !gap) {
+			sample(prog, points, a, fa, m, fm, depth + 1, maybe);
+			sample(prog, points, m, fm, b, fb, depth + 1, maybe);
+			return;
+		}
+
+		push_break(points);
+		if (isfinite(fb))
+			push_point(prog, points, b, fb);
+
+		return;
+	}
+
+	if (maybe) {
+		struct expr_interval bounds;
+		maybe = expr_eval_interval(prog, a, b, &bounds) != 0;
+	}
+
+	const float err = fabsf(fm - (fa + fb) / 2) * GRAPH_SCALE;
+	if (!maybe && isfinite(fm) && err <= GRAPH_TOLERANCE) {
+		push_point(prog, points, b, fb);
+		return;
+	}
+
+	if (depth < GRAPH_DEPTH) {
+		sample(prog, points, a, fa, m, fm, depth + 1, maybe);
+		sample(prog, points, m, fm, b, fb, depth + 1, maybe);
+		return;
+	}
+
+	const _Bool between = fm > fminf(fa, fb) && fm < fmaxf(fa, fb);
+	if (!isfinite(fm) ||
+	    (maybe && !between && fabsf(fb - fa) * GRAPH_SCALE > GRAPH_SCALE))
+		push_break(points);
+
+	push_point(prog, points, b, fb);
+}
+
+void graph_sample(const struct expr_prog *prog, int index,
+		  struct graph_samples *points)
+{
+	const size_t n = GRAPH_COARSE + 1;
+
+	//   Both edges are computed from whole world units, so neighbouring
+	// chunks share the exact same sample where they meet.
+	const float left = (float)index * GRAPH_CHUNK_WIDTH;
+	const float step = (float)GRAPH_CHUNK_WIDTH / GRAPH_COARSE;
+
+	float xs[GRAPH_COARSE + 1];
+	float ys[GRAPH_COARSE + 1];
+
+	for (size_t i = 0; i < n; ++i)
+		xs[i] = (left + step * (float)i) / GRAPH_SCALE;
+
+	// straight graphs are exact with just their ends
+	if (prog->degree == 0 || prog->degree == 1) {
+		push_point(prog, points, xs[0], expr_eval(prog, xs[0]));
+		push_point(prog, points, xs[n - 1], expr_eval(prog, xs[n - 1]));
+		return;
+	}
+
+	expr_eval_batch(prog, xs, ys, n);
+
+	if (isfinite(ys[0]))
+		push_point(prog, points, xs[0], ys[0]);
+
+	for (size_t i = 0; i + 1 < n; ++i)
+		sample(prog, points, xs[i], ys[i], xs[i + 1], ys[i + 1], 0, 1);
+}
+
+//   The grid is evaluated at twice its resolution. The odd points are the
+// midpoints that decide breaks the same way sample() does at its finest, and
+// give the even points their slopes by central differences. Breaks are only
+// looked for in the coarse intervals that interval evaluation says may break.
+void graph_sample_uniform(const struct expr_prog *prog, int index,
+			  struct graph_samples *points)
+{
+	// one extra point on either side for the slopes at the edges
+	const size_t n = 2 * GRAPH_UNIFORM + 3;
+	const size_t per_coarse = GRAPH_UNIFORM / GRAPH_COARSE;
+
+	const float left = (float)index * GRAPH_CHUNK_WIDTH;
+	const float half = (float)GRAPH_CHUNK_WIDTH / GRAPH_UNIFORM / 2;
+	const float step = (float)GRAPH_CHUNK_WIDTH / GRAPH_COARSE;
+
+	float xs[2 * GRAPH_UNIFORM + 3];
+	float ys[2 * GRAPH_UNIFORM + 3];
+
+	for (size_t i = 0; i < n; ++i)
+		xs[i] = (left + half * ((float)i - 1)) / GRAPH_SCALE;
+
+	expr_eval_batch(prog, xs, ys, n);
+
+	_Bool maybe[GRAPH_COARSE];
+	for (size_t c = 0; c < GRAPH_COARSE; ++c) {
+		struct expr_interval bounds;
+		maybe[c] = expr_eval_interval(
+				   prog, (left + step * (float)c) / GRAPH_SCALE,
+				   (left + step * (float)(c + 1)) / GRAPH_SCALE,
+				   &bounds) != 0;
+	}
+
+	const float h = 2 * half / GRAPH_SCALE;
+
+	for (size_t i = 1; i < n - 1; i += 2) {
+		const float fb = ys[i];
+		if (!isfinite(fb)) {
+			push_break(points);
+			continue;
+		}
+
+		if (i > 1) {
+			const float fa = ys[i - 2];
+			const float fm = ys[i - 1];
+			const _Bool between = fm > fminf(fa, fb) &&
+					      fm < fmaxf(fa, fb);
+			const _Bool jump = maybe[(i - 3) / 2 / per_coarse] &&
+					   !between &&
+					   fabsf(fb - fa) * GRAPH_SCALE >
+						   GRAPH_SCALE;
+
+			if (!isfinite(fm) || jump)
+				push_break(points);
+		}
+
+		const float dy = (ys[i + 1] - ys[i - 1]) / h;
+		graph_samples_push(points,
+				   (Vector2){ xs[i] * GRAPH_SCALE,
+					      -fb * GRAPH_SCALE },
+				   graph_slope_normal(dy));
+	}
+}
+
+// Marks the samples from <first> to <last> that are kept at <tolerance>.
+static void simplify(const struct graph_samples *s, size_t first, size_t last,
+		     float tolerance, _Bool *mark, size_t *stack)
+{
+	size_t top = 0;
+
+	mark[first] = mark[last] = 1;
+	stack[top++] = first;
+	stack[top++] = last;
+
+	while (top > 0) {
+		const size_t b = stack[--top];
+		const size_t a = stack[--top];
+
+		const float dx = s->x[b] - s->x[a];
+		const float dy = s->y[b] - s->y[a];
+		const float len2 = dx * dx + dy * dy;
+
+		float farthest = 0;
+		size_t at = a;
+
+		//   The distance is to the segment rather than the line through it,
+		// steep stretches fold back past the ends of it.
+		for (size_t i = a + 1; i < b; ++i) {
+			const float px = s->x[i] - s->x[a];
+			const float py = s->y[i] - s->y[a];
+			const float u = len2 > 0 ?
+				fminf(fmaxf((px * dx + py * dy) / len2, 0), 1) : 0;
+			const float d = hypotf(px - u * dx, py - u * dy);
+
+			if (d > farthest) {
+				farthest = d;
+				at = i;
+			}
+		}
+
+		if (farthest <= tolerance)
+			continue;
+
+		mark[at] = 1;
+		if (at - a > 1) {
+			stack[top++] = a;
+			stack[top++] = at;
+		}
+		if (b - at > 1) {
+			stack[top++] = at;
+			stack[top++] = b;
+		}
+	}
+}
+
+size_t graph_simplify(const struct graph_samples *s, float tolerance,
+		      size_t *keep)
+{
+	if (s->count == 0)
+		return 0;
+
+	//   Every pair on the stack is split off one kept sample, so it never
+	// holds more pairs than there are samples.
+	_Bool *mark = calloc(s->count, sizeof *mark);
+	size_t *stack = malloc(2 * s->count * sizeof *stack);
+
+	size_t start = 0;
+	for (size_t i = 0; i <= s->count; ++i) {
+		if (i < s->count && !graph_break(s->x[i]))
+			continue;
+
+		if (i > start)
+			simplify(s, start, i - 1, tolerance, mark, stack);
+		if (i < s->count)
+			mark[i] = 1;
+
+		start = i + 1;
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < s->count; ++i) {
+		if (mark[i])
+			keep[n++] = i;
+	}
+
+	free(mark);
+	free(stack);
+	return n;
+}
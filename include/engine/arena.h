@@ -0,0 +1,27 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+//   A bump allocator. Allocations are never freed one by one; the whole arena
+// is reset at once and its blocks are handed out again from the start.
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	_Alignas(max_align_t) unsigned char data[];
+};
+
+struct arena {
+	struct arena_block *first, *cur;
+	size_t block_size;
+};
+
+struct arena arena_create(size_t block_size);
+void arena_destroy(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_calloc(struct arena *arena, size_t nmemb, size_t size);
+void arena_reset(struct arena *arena);
+
+#endif
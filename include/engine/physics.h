@@ -13,7 +13,10 @@ void physics_pause(void);
 void physics_resume(void);
 _Bool physics_is_paused(void);
 
-void resolve_collision(Vector2 coll);
+struct contact;
+
+// Pushes the player out of <contact> by its depth and responds to the hit.
+void resolve_collision(const struct contact *contact);
 
 static float calculate_circle_inertia(float r)
 {
@@ -5,6 +5,8 @@
 #include "level.h"
 
 void render_init(void);
+//   Draws the world with the game's camera, so it is called outside of
+// BeginMode2D(). What does not move comes from a cached layer.
 void render(void);
 void render_feed_leveldata(const struct leveldata *data);
 
@@ -0,0 +1,103 @@
+#ifndef __EXPR_H__
+#define __EXPR_H__
+
+#include "engine/arena.h"
+#include <stddef.h>
+
+// The deepest value stack a compiled formula may need.
+#define EXPR_STACK_MAX 64
+// How many x values the batched evaluator carries through each instruction.
+#define EXPR_BATCH 64
+// How many shared subexpressions a program may keep around for reuse.
+#define EXPR_REGS 16
+// The highest degree of polynomial that is evaluated in closed form.
+#define EXPR_POLY_MAX 8
+
+enum expr_op {
+	EOP_CONST,
+	EOP_X,
+	EOP_T,
+	EOP_NEG,
+	EOP_ADD,
+	EOP_SUB,
+	EOP_MUL,
+	EOP_DIV,
+	EOP_POW,
+	EOP_SIN,
+	EOP_ABS,
+	EOP_TAN,
+	EOP_STORE, // copies the top of the stack into a register
+	EOP_LOAD, // pushes a register
+};
+
+typedef float (*expr_native_f)(float x, float t);
+
+struct expr_ins {
+	enum expr_op op;
+	union {
+		float imm;
+		unsigned reg;
+	};
+};
+
+//   A formula lowered into a flat postfix program for a stack machine.
+// Function names are resolved to opcodes at compile time, so evaluating
+// the program never touches the original string or the syntax tree.
+struct expr_prog {
+	struct expr_ins *code;
+	size_t len;
+	size_t depth; // the maximum stack depth reached
+	size_t nregs;
+	size_t nodes; // how many syntax tree nodes the parser built
+
+	//   Formulas that reduce to a polynomial in x also keep its coefficients,
+	// lowest power first, and are evaluated in Horner form. <degree> is -1
+	// for everything else, including formulas that read t.
+	int degree;
+	double coef[EXPR_POLY_MAX + 1];
+
+	//   The value t takes while the program is evaluated, in seconds since
+	// the level started. <timed> is 0 if the formula never reads it.
+	float t;
+	_Bool timed;
+
+	// machine code for the program, if it has been through expr_jit()
+	expr_native_f native;
+	size_t native_size;
+};
+
+struct expr_interval {
+	float lo, hi;
+};
+
+//   The syntax tree lives in <arena> and is dead once this returns, the
+// program itself is heap allocated and released with expr_destroy().
+int expr_compile(struct expr_prog *prog, const char *s, struct arena *arena);
+void expr_destroy(struct expr_prog *prog);
+
+// Lexes <s> and returns how many tokens it holds.
+size_t expr_count_tokens(const char *s);
+
+//   Writes <s> to <dst> without the characters the lexer skips, so formulas
+// that only differ in spacing come out the same. <dst> needs room for
+// strlen(s) + 1 characters. Returns the length written.
+size_t expr_normalize(char *dst, const char *s);
+
+float expr_eval(const struct expr_prog *prog, float x);
+// Like expr_eval(), and also stores the exact slope f'(x) in <dy>.
+float expr_eval_dual(const struct expr_prog *prog, float x, float *dy);
+void expr_eval_batch(const struct expr_prog *prog, const float *xs, float *ys,
+		     size_t n);
+
+//   Bounds the formula over every x from <x0> to <x1>. The bounds hold for the
+// exact value of the formula, not only for the sampled floats. Returns 1 if
+// the formula may be discontinuous or undefined somewhere in the interval,
+// at a pole of tan, a division by zero or a power of a negative number, and
+// 0 if it is continuous throughout.
+int expr_eval_interval(const struct expr_prog *prog, float x0, float x1,
+		       struct expr_interval *y);
+
+int expr_jit(struct expr_prog *prog);
+void expr_jit_release(struct expr_prog *prog);
+
+#endif
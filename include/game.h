@@ -6,18 +6,16 @@
 #include <engine/arraylist.h>
 #include <raylib.h>
 
-typedef float (*graph_t)(float);
-
 struct game {
 	struct window *window;
 	struct Camera2D camera;
 	struct player *player;
-	graph_t *graphs;
-	int ngraphs;
 	char *tip;
 	struct leveldata level;
 
-	struct arraylist graph_points;
+	//   How far the frame is drawn between the last two physics steps, from
+	// 0 at the one before to 1 at the last.
+	float alpha;
 
 	struct {
 		Texture2D main;
@@ -29,6 +27,7 @@ struct game {
 void game_init(struct window *window);
 
 // fixed_update() -> update() -> late_update() -> final_update()
+// fixed_update() runs as many times a frame as PHYSICS_RATE calls for
 
 void fixed_update(float fdt); // physics calculations
 void update(void); // misc
@@ -6,4 +6,10 @@
 #define ZOOM_DELTA 0.2F
 #define ZOOM_RATE 12.0F
 
+// How many physics steps are taken per second, whatever the frame rate.
+#define PHYSICS_RATE 120
+//   The most physics steps one frame may take. Time past that is dropped, so
+// a long frame slows the game down rather than stalling the frames after it.
+#define PHYSICS_STEPS_MAX 8
+
 #endif
@@ -1,13 +1,156 @@
 #ifndef __GRAPH_H__
 #define __GRAPH_H__
 
+#include "expr.h"
 #include <raylib.h>
+#include <stddef.h>
+#include <math.h>
 
 #define GRAPH_SCALE 30
+// Width of the chunks the graph is sampled in, in world units.
+#define GRAPH_CHUNK_WIDTH 256
+// How many chunks are sampled past what the camera and the player need.
+#define GRAPH_CHUNK_MARGIN 2
+// How many chunks further out are kept around before they are dropped.
+#define GRAPH_CHUNK_KEEP 4
+// How many chunks a graph may hold at once.
+#define GRAPH_CHUNKS_MAX 128
+// How many intervals a chunk is split into before refining.
+#define GRAPH_COARSE 16
+// How many times a coarse interval may be halved while refining.
+#define GRAPH_DEPTH 8
+// How far, in pixels, the polyline may stray from the curve.
+#define GRAPH_TOLERANCE 0.25F
+// How many even intervals a chunk of a moving graph is sampled in.
+#define GRAPH_UNIFORM 128
+// How many levels of detail a still graph's ribbon is kept at.
+#define GRAPH_LOD_LEVELS 4
+//   How far, in screen pixels, a level of detail may stray from the samples
+// for it to be drawn.
+#define GRAPH_LOD_ERROR 0.5F
+// How many compiled formulas are kept around with their samples.
+#define GRAPH_CACHE_SIZE 8
+// How many formulas may be played on at once, separated by GRAPH_SEPARATOR.
+#define GRAPH_MAX 4
+#define GRAPH_SEPARATOR ';'
+// Swapping in a new set claims the cached graphs of it before adding the rest.
+_Static_assert(GRAPH_CACHE_SIZE >= 2 * GRAPH_MAX,
+	       "the cache must fit a set of claimed graphs and a set of new ones");
+// How many segments a leaf of a run's bounding tree covers.
+#define GRAPH_LEAF 8
+// How many nodes of the level below each node of a bounding tree covers.
+#define GRAPH_FANOUT 4
+// Enough levels for a bounding tree over any run.
+#define GRAPH_TREE_LEVELS 32
+
+//   Samples in structure of arrays form, all four arrays cut from one block.
+// Positions are in the same flipped space as the player, normals are unit
+// length and come from the exact slope at each position.
+struct graph_samples {
+	float *x, *y;
+	float *nx, *ny;
+	size_t count, cap;
+};
+
+//   The samples of one formula over one chunk, as a slice of the shared store.
+// Runs are ordered by chunk, and by formula within a chunk.
+struct graph_run {
+	int chunk;
+	unsigned graph; // the formula's place in the list it was given in
+	size_t start, count;
+	float top, bottom; // the extent of the samples, in the player's space
+	size_t tree; // where the run's bounding tree starts
+};
+
+// A box in the player's space, <top> is the smaller y.
+struct graph_box {
+	float left, right, top, bottom;
+};
+
+//   Walks the leaves of a run's bounding tree whose boxes meet <box>, left to
+// right. Every node bounds the samples of the nodes below it, so whole
+// stretches of the run that are out of the way are passed over at once.
+struct graph_query {
+	const struct graph_run *run;
+	struct graph_box box;
+
+	size_t offset[GRAPH_TREE_LEVELS]; // where each level starts
+	size_t stack[GRAPH_TREE_LEVELS * GRAPH_FANOUT];
+	unsigned char level[GRAPH_TREE_LEVELS * GRAPH_FANOUT];
+	size_t top;
+};
 
 void graph_init(void);
+//   Runs at every physics step. Swaps in finished builds and keeps what the
+// player may touch sampled at level_time(), which is all that collision and
+// a replay's hash see.
+void graph_update(void);
+//   Runs once a frame, before drawing. Samples whatever the camera sees at
+// the current time.
+void graph_update_view(void);
 void render_graph(void);
 void build_fgraph(const char *expr);
+//   Whether the formulas last given to build_fgraph() are still being built.
+// Once they are in place, or turn out not to compile, it is 0.
+_Bool graph_pending(void);
+// The formulas last given to build_fgraph().
+const char *graph_formula(void);
 void render_fgraph_old(float (*f)(float x), Color color);
 
+// The unit normal of formula <graph> at world x <x>, in the player's space.
+Vector2 graph_normal(unsigned graph, float x);
+
+//   Samples chunk <index> of the formula and appends the samples to <points>,
+// refining until the polyline is within GRAPH_TOLERANCE.
+void graph_sample(const struct expr_prog *prog, int index,
+		  struct graph_samples *points);
+//   Samples chunk <index> of a moving formula on an even grid, evaluated in a
+// single batch. It is cheap enough to run for every visible chunk each frame.
+void graph_sample_uniform(const struct expr_prog *prog, int index,
+			  struct graph_samples *points);
+//   Simplifies every unbroken stretch of <s> with Douglas-Peucker, so that
+// no sample is further than <tolerance> from the polyline left. Breaks and
+// the ends of stretches are always kept. <keep> needs room for s->count
+// indices and gets the ones kept, in order. Returns how many there are.
+size_t graph_simplify(const struct graph_samples *s, float tolerance,
+		      size_t *keep);
+// Turns a slope into the unit normal the graph's samples carry.
+Vector2 graph_slope_normal(float dy);
+
+// Makes room for <cap> samples in all, keeping the ones already there.
+void graph_samples_reserve(struct graph_samples *s, size_t cap);
+void graph_samples_push(struct graph_samples *s, Vector2 pos, Vector2 normal);
+void graph_samples_destroy(struct graph_samples *s);
+
+//   The samples of every formula being played on, for every chunk that has
+// been sampled, in one buffer.
+const struct graph_samples *graph_store(void);
+//   Goes up every time the store changes, and with it what render_graph()
+// draws at a given camera.
+unsigned long graph_generation(void);
+
+//   Returns the runs of the store that cover chunks <lo> to <hi>, both
+// included. They are contiguous, and <count> gets how many there are. The
+// first and last sample of a run sit on its chunk's edges.
+const struct graph_run *graph_runs(int lo, int hi, size_t *count);
+
+void graph_query_begin(struct graph_query *q, const struct graph_run *run,
+		       struct graph_box box);
+//   Gives the samples of the next leaf that meets the query's box, the
+// segments between <first> and <last> are the ones to test. Returns 0 once
+// there are none left.
+_Bool graph_query_next(struct graph_query *q, size_t *first, size_t *last);
+
+static inline int graph_chunk_index(float x)
+{
+	return (int)floorf(x / GRAPH_CHUNK_WIDTH);
+}
+
+//   The sampled polyline is broken at discontinuities by a sample whose
+// coordinates are NaN. The segments on either side of it are not connected.
+static inline _Bool graph_break(float x)
+{
+	return isnan(x);
+}
+
 #endif
@@ -10,7 +10,7 @@ struct obstacle {
 };
 
 struct leveldata {
-	char func[64];
+	char func[256]; // one or more formulas, separated by GRAPH_SEPARATOR
 	Vector2 a, b, star;
 	struct arraylist obstacles;
 };
@@ -19,6 +19,15 @@ int load_level_num(int n);
 void reload_level(void);
 void level_control(void);
 _Bool level_star_collected(void);
+//   Seconds of physics since the level was loaded, the t that formulas read.
+// It moves on one step at a time, so a run sees the same t when replayed.
+float level_time(void);
+// Counts one physics step, paused or not.
+void level_tick(void);
+unsigned long level_ticks(void);
+void level_seek(unsigned long ticks);
+// The number the level was loaded by, -1 if it was not loaded by number.
+int level_number(void);
 
 void level_finish(void);
 
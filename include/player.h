@@ -2,16 +2,21 @@
 #define __PLAYER_H__
 
 #include <raylib.h>
+#include <stddef.h>
 
 struct player {
 	Vector2 pos, old_pos;
 	float radius, rotation;
 
+	// where the last physics step started, drawn between it and <pos>
+	Vector2 prev_pos;
+	float prev_rotation;
+
 	Texture2D tex;
 	float tex_size;
 	Color tint;
 
-	struct {
+	struct player_body {
 		float mass;
 		Vector2 linear_velocity, linear_accel, force, friction;
 		float angular_velocity;
@@ -21,7 +26,24 @@ struct player {
 	} body;
 };
 
-_Bool player_collides(Vector2 *point, int id);
+// The most contacts player_contacts() reports in one call.
+#define PLAYER_CONTACTS_MAX 32
+
+struct contact {
+	Vector2 point; // on the surface that was hit
+	Vector2 normal; // unit length, facing the player
+	float depth; // how far the player reaches into the surface
+	int source; // 0 for the graph, 1 + i for obstacle i
+};
+
+//   Tests the player against the graph and every obstacle in one pass and
+// writes up to <max> contacts to <contacts>, the graph's first. Returns how
+// many there are.
+size_t player_contacts(struct contact *contacts, size_t max);
+//   How far along <step>, from 0 to 1, the player can move before it first
+// touches the graph. Surfaces it already touches only stop it from moving
+// through them.
+float player_sweep_graph(Vector2 step);
 _Bool player_collides_with(Vector2 p);
 void player_init(void);
 void reset_player(void);
@@ -0,0 +1,39 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "player.h"
+#include <raylib.h>
+
+// Where a recording is written to and played back from.
+#define REPLAY_FILE "replay.bin"
+
+//   Everything from the outside that reaches the physics over one step. The
+// rest of a step follows from the state the run started in.
+struct replay_input {
+	Vector2 nudge; // added to the ball's velocity
+	_Bool paused;
+};
+
+//   Starts recording a run of <formula> on level <level> from the state the
+// game is in now. A recording ends with replay_stop().
+void replay_record(int level, const char *formula);
+//   Loads the level and the formula of the log at <path> and plays the run
+// back, step by step, from the state it was recorded in. Returns -1 if the
+// log cannot be read.
+int replay_play(const char *path);
+// Writes out a recording, or gives up on a playback. Does nothing otherwise.
+void replay_stop(void);
+
+_Bool replay_recording(void);
+_Bool replay_playing(void);
+
+//   Called at the start of every physics step. A recording logs <input>, a
+// playback overwrites it with the logged one. Returns 0 if the step is to be
+// skipped, while a playback waits for its formula to be built.
+_Bool replay_input(struct replay_input *input);
+//   Called at the end of every physics step. Folds the player's state into
+// the run's rolling hash, and during a playback reports the first step whose
+// hash differs from the one logged.
+void replay_check(const struct player *player);
+
+#endif
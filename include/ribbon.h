@@ -0,0 +1,33 @@
+#ifndef __RIBBON_H__
+#define __RIBBON_H__
+
+#include "graph.h"
+#include <raylib.h>
+#include <stddef.h>
+
+// How far the ribbon reaches out to either side of the samples.
+#define RIBBON_WIDTH 5
+
+//   The textured strip drawn over a chunk's samples, or over some of them.
+// It is built wherever the samples are made and uploaded the first time it
+// is drawn. <stale> marks an uploaded ribbon whose vertices changed since.
+struct ribbon {
+	Mesh mesh;
+	_Bool uploaded, stale;
+};
+
+//   Tessellates the <n> samples of <s> whose indices are listed in <keep>, or
+// the first <n> if <keep> is NULL. A ribbon that already has room for them is
+// rebuilt in place.
+void ribbon_build(struct ribbon *r, const struct graph_samples *s,
+		  const size_t *keep, size_t n);
+
+//   Only a ribbon that was never uploaded can be let go of without the GL
+// context, which is all the worker thread ever builds.
+void ribbon_free(struct ribbon *r);
+
+//   Uploads the ribbon the first time it is drawn, and streams in vertices
+// that changed since. <dynamic> ribbons are expected to change every frame.
+void ribbon_draw(struct ribbon *r, Material material, _Bool dynamic);
+
+#endif